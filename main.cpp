@@ -1,6 +1,27 @@
 
 #include "httplib.h"
 #include <libpq-fe.h>
+#ifdef EXTRUSION_ZLIB
+#include <zlib.h>
+#endif
+#ifdef EXTRUSION_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#if __has_include(<linux/io_uring.h>)
+#define EXTRUSION_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#endif
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -10,92 +31,4365 @@
 #include <iomanip>
 #include <memory>
 #include <mutex>
+#include <algorithm>
+#include <unordered_map>
+#include <array>
+#include <optional>
+#include <thread>
+#include <future>
+#include <deque>
+#include <condition_variable>
+#include <functional>
+#include <filesystem>
+#include <atomic>
+#include <list>
+#include <variant>
+#include <span>
+#include <bit>
+#include <limits>
+#include <charconv>
+#include <string_view>
 #include "nlohmannjson.hpp"
 #include <iomanip>
 #include <sstream>
 
+using namespace std;
+using json = nlohmann::json;
+
+// === ФОРМАТИРОВАНИЕ ЧИСЕЛ ===
+// std::to_chars без потоков и локалей: числа дописываются прямо в конец выходной строки,
+// место под них резервируется заранее. Два режима: фиксированное число знаков (ключи таблиц, CSV)
+// и кратчайшая запись, из которой читается то же самое double (JSON).
+const size_t NUMBER_CHARS_MAX = 32;  // кратчайшая запись double не длиннее 24 символов
+
+inline void append_fixed(string& out, double v, int precision) {
+    size_t at = out.size();
+    out.resize(at + NUMBER_CHARS_MAX);
+    auto r = std::to_chars(out.data() + at, out.data() + out.size(), v, std::chars_format::fixed, precision);
+    if (r.ec != std::errc()) {
+        // Очень большие по модулю значения в фиксированной записи длиннее буфера
+        out.resize(at + 330 + precision);
+        r = std::to_chars(out.data() + at, out.data() + out.size(), v, std::chars_format::fixed, precision);
+    }
+    out.resize(r.ptr - out.data());
+}
+
+// Не-конечные значения в JSON не представимы и пишутся как null (так же делает json::dump)
+inline void append_shortest(string& out, double v) {
+    if (!std::isfinite(v)) {
+        out += "null";
+        return;
+    }
+    size_t at = out.size();
+    out.resize(at + NUMBER_CHARS_MAX);
+    auto r = std::to_chars(out.data() + at, out.data() + out.size(), v);
+    out.resize(r.ptr - out.data());
+}
+
 // ВСЕГДА возвращает строку с .0, если целое
-std::string to_fixed(double val) {
-    std::ostringstream oss;
-    oss << std::fixed << std::setprecision(1) << val;
-    return oss.str();
+string to_fixed(double val) {
+    string s;
+    append_fixed(s, val, 1);
+    return s;
+}
+
+// Потоковая сборка JSON в одну строку — для больших числовых ответов вместо json::dump()
+class JsonWriter {
+    string out;
+    bool first = true;  // следующий элемент в текущем контейнере — первый, запятая не нужна
+
+    void sep() {
+        if (!first) out += ',';
+        first = false;
+    }
+
+    void quoted(std::string_view s) {
+        out += '"';
+        for (char c : s) {
+            switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned>(c));
+                    out += buf;
+                }
+                else out += c;
+            }
+        }
+        out += '"';
+    }
+
+public:
+    explicit JsonWriter(size_t reserve = 0) { out.reserve(reserve); }
+
+    JsonWriter& begin_object() { sep(); out += '{'; first = true; return *this; }
+    JsonWriter& end_object() { out += '}'; first = false; return *this; }
+    JsonWriter& begin_array() { sep(); out += '['; first = true; return *this; }
+    JsonWriter& end_array() { out += ']'; first = false; return *this; }
+
+    JsonWriter& key(std::string_view k) {
+        sep();
+        quoted(k);
+        out += ':';
+        first = true;  // значение после ключа идёт без запятой
+        return *this;
+    }
+
+    JsonWriter& value(double v) { sep(); append_shortest(out, v); return *this; }
+    JsonWriter& value(uint64_t v) { sep(); out += std::to_string(v); return *this; }
+    JsonWriter& value(std::string_view s) { sep(); quoted(s); return *this; }
+    JsonWriter& value(const char* s) { return value(std::string_view(s)); }
+
+    // Уже сериализованный фрагмент (например, json::dump() небольшого объекта)
+    JsonWriter& raw(std::string_view fragment) { sep(); out += fragment; return *this; }
+
+    JsonWriter& numbers(const double* v, size_t n) {
+        begin_array();
+        for (size_t i = 0; i < n; i++) {
+            if (i) out += ',';
+            append_shortest(out, v[i]);
+        }
+        return end_array();
+    }
+    JsonWriter& numbers(const vector<double>& v) { return numbers(v.data(), v.size()); }
+
+    size_t size() const { return out.size(); }
+    string take() { return std::move(out); }
+};
+
+// === ПУЛ СОЕДИНЕНИЙ (thread-safe) ===
+class DBPool {
+private:
+    std::vector<PGconn*> pool;
+    std::mutex pool_mutex;
+    const char* conninfo;
+
+    void configure_conn(PGconn* conn) {
+        if (conn && PQstatus(conn) == CONNECTION_OK) {
+            PQsetNoticeReceiver(conn, nullptr, nullptr);
+            PQsetErrorVerbosity(conn, PGVerbosity(0));  // TERSE
+        }
+    }
+
+public:
+    DBPool(const char* ci, size_t size = 5) : conninfo(ci) {
+        for (size_t i = 0; i < size; ++i) {
+            PGconn* conn = PQconnectdb(conninfo);
+            if (PQstatus(conn) == CONNECTION_OK) {
+                configure_conn(conn);
+                pool.push_back(conn);
+            }
+            else {
+                std::cerr << "Failed to create connection " << i << ": " << PQerrorMessage(conn) << std::endl;
+                PQfinish(conn);
+            }
+        }
+    }
+
+    ~DBPool() {
+        for (auto conn : pool) {
+            if (conn) PQfinish(conn);
+        }
+    }
+
+    PGconn* get() {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        if (pool.empty()) return nullptr;
+        PGconn* conn = pool.back();
+        pool.pop_back();
+        return conn;
+    }
+
+    void put(PGconn* conn) {
+        if (!conn) return;
+        if (PQstatus(conn) != CONNECTION_OK) {
+            PQfinish(conn);
+            conn = PQconnectdb(conninfo);
+        }
+        configure_conn(conn);
+        if (conn && PQstatus(conn) == CONNECTION_OK) {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            pool.push_back(conn);
+        }
+        else {
+            if (conn) PQfinish(conn);
+        }
+    }
+};
+
+// Глобальный пул
+std::unique_ptr<DBPool> db_pool;
+
+// === УТИЛИТЫ ===
+namespace fs = std::filesystem;
+
+auto safe_escape = [](PGconn* conn, const string& s) -> string {
+    if (s.empty()) return "NULL";
+    char* esc = PQescapeLiteral(conn, s.c_str(), s.size());
+    if (!esc) return "NULL";
+    string result = esc;
+    PQfreemem(esc);
+    return result;
+    };
+
+string to_hex(const unsigned char* data, size_t size) {
+    static const char* digits = "0123456789abcdef";
+    string out;
+    out.reserve(size * 2);
+    for (size_t i = 0; i < size; i++) {
+        out += digits[data[i] >> 4];
+        out += digits[data[i] & 0x0f];
+    }
+    return out;
+}
+
+// SHA-256 в hex; bytes — сколько первых байт дайджеста оставить
+string sha256_hex(const string& data, size_t bytes = 32) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_Digest(data.data(), data.size(), md, &len, EVP_sha256(), nullptr);
+    return to_hex(md, std::min<size_t>(bytes, len));
+}
+
+// Криптостойкие случайные байты (OpenSSL) в hex
+string random_hex(size_t bytes) {
+    vector<unsigned char> buf(bytes);
+    if (RAND_bytes(buf.data(), static_cast<int>(bytes)) != 1) throw std::runtime_error("RAND_bytes failed");
+    return to_hex(buf.data(), buf.size());
+}
+
+// Числовой параметр из переменной окружения или значение по умолчанию
+long env_long(const char* name, long def) {
+#ifdef _WIN32
+    char* raw = nullptr;
+    size_t len = 0;
+    if (_dupenv_s(&raw, &len, name) != 0 || !raw) return def;
+    string value = raw;
+    free(raw);
+#else
+    const char* raw = getenv(name);
+    if (!raw) return def;
+    string value = raw;
+#endif
+    try { return stol(value); }
+    catch (...) { return def; }
+}
+
+// === ВЕРСИИ КАТАЛОГОВ (ETag) ===
+// Счётчик растёт при каждой успешной записи через API. Эпоха (время запуска) входит в ETag,
+// чтобы после перезапуска сервера старые теги клиентов не совпали с обнулённым счётчиком.
+// Изменения, сделанные в БД в обход API, версию не меняют.
+const string SERVER_EPOCH = to_string(chrono::duration_cast<chrono::seconds>(
+    chrono::system_clock::now().time_since_epoch()).count());
+
+struct CatalogVersion {
+    const char* name;
+    std::atomic<uint64_t> value{ 1 };
+
+    explicit CatalogVersion(const char* n) : name(n) {}
+
+    string etag() const {
+        return "\"" + string(name) + "-" + SERVER_EPOCH + "-" + to_string(value.load()) + "\"";
+    }
+    void bump() { value.fetch_add(1); }
+};
+
+CatalogVersion materials_version("materials");
+CatalogVersion users_version("users");
+
+// Сравнение для If-None-Match: список тегов через запятую или "*", префикс W/ игнорируется
+bool etag_matches(const string& header, const string& etag) {
+    std::stringstream ss(header);
+    string tag;
+    while (getline(ss, tag, ',')) {
+        size_t b = tag.find_first_not_of(" \t");
+        size_t e = tag.find_last_not_of(" \t");
+        if (b == string::npos) continue;
+        tag = tag.substr(b, e - b + 1);
+        if (tag == "*") return true;
+        if (tag.rfind("W/", 0) == 0) tag = tag.substr(2);
+        if (tag == etag) return true;
+    }
+    return false;
+}
+
+// If-Range (RFC 9110, 13.1.5): Range выполняется, только если тег совпадает при строгом сравнении.
+// Слабые теги и даты не совпадают никогда — клиент получит файл целиком и начнёт заново.
+bool if_range_matches(const httplib::Request& req, const string& etag) {
+    if (!req.has_header("If-Range")) return true;
+    string tag = req.get_header_value("If-Range");
+    size_t b = tag.find_first_not_of(" \t");
+    size_t e = tag.find_last_not_of(" \t");
+    return b != string::npos && tag.compare(b, e - b + 1, etag) == 0;
+}
+
+// Отменяет Range: httplib разбирает заголовок до маршрутизации и режет по req.ranges тело
+// из content provider даже при явном статусе 200, а для потоковых ответов отвечает 416.
+void ignore_range(const httplib::Request& req) {
+    const_cast<httplib::Request&>(req).ranges.clear();
+}
+
+// Ставит ETag и Cache-Control; true — у клиента актуальная копия, ответ 304 уже сформирован.
+// Версию нужно брать ДО запроса к БД: при гонке с записью клиент получит устаревший тег и перезапросит.
+bool not_modified(const httplib::Request& req, httplib::Response& res, const string& etag) {
+    res.set_header("ETag", etag);
+    res.set_header("Cache-Control", "private, no-cache");
+    if (req.has_header("If-None-Match") && etag_matches(req.get_header_value("If-None-Match"), etag)) {
+        res.status = 304;
+        return true;
+    }
+    return false;
+}
+
+// === ПАГИНАЦИЯ МАТЕРИАЛОВ ===
+const vector<string> MATERIAL_FIELDS = { "id", "name", "mu0", "b", "T0", "n" };
+const int MATERIALS_PAGE_MAX = 500;
+
+// Курсор — hex от "id:name" последней строки страницы, для клиента непрозрачен
+string encode_cursor(const string& name, int id) {
+    string raw = to_string(id) + ":" + name;
+    return to_hex(reinterpret_cast<const unsigned char*>(raw.data()), raw.size());
+}
+
+bool decode_cursor(const string& cursor, string& name, int& id) {
+    if (cursor.empty() || cursor.size() % 2 != 0) return false;
+    string raw;
+    raw.reserve(cursor.size() / 2);
+    for (size_t i = 0; i < cursor.size(); i += 2) {
+        int byte = 0;
+        if (!httplib::detail::from_hex_to_i(cursor, i, 2, byte)) return false;
+        raw += static_cast<char>(byte);
+    }
+    size_t sep = raw.find(':');
+    if (sep == string::npos || sep == 0) return false;
+    try { id = stoi(raw.substr(0, sep)); }
+    catch (...) { return false; }
+    name = raw.substr(sep + 1);
+    return true;
+}
+
+// Экранирует метасимволы LIKE (escape-символ по умолчанию — обратный слэш)
+string like_escape(const string& s) {
+    string out;
+    out.reserve(s.size());
+    for (char c : s) {
+        if (c == '%' || c == '_' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+// === СНИМОК КАТАЛОГА МАТЕРИАЛОВ (RCU) ===
+// Неизменяемая версия таблицы materials вместе с готовым JSON полного списка.
+// Читатели берут shared_ptr одной атомарной загрузкой без блокировок; писатели после
+// успешного INSERT/DELETE перечитывают таблицу и публикуют новый снимок целиком.
+// Старый снимок освобождается, когда его отпустит последний читатель.
+// Если перечитать не удалось (все соединения пула заняты, ошибка БД), остаётся прежний снимок:
+// он помечается устаревшим (версия меньше materials_version), и повтор делается не чаще
+// раза в CATALOG_RETRY при следующих обращениях.
+const auto CATALOG_RETRY = chrono::seconds(1);
+struct Material {
+    int id;
+    string name;
+    double mu0, b, T0, n;
+};
+
+struct CatalogSnapshot {
+    uint64_t version = 0;
+    string etag;
+    vector<Material> items;                 // в порядке (name, id), как в GET /api/materials
+    std::unordered_map<int, size_t> by_id;  // id -> индекс в items
+    string body;                            // сериализованный items
+
+    const Material* find(int id) const {
+        auto it = by_id.find(id);
+        return it == by_id.end() ? nullptr : &items[it->second];
+    }
+
+    // false — после снимка каталог менялся, а перечитать его ещё не удалось
+    bool fresh() const { return version == materials_version.value.load(); }
+};
+
+class MaterialCatalog {
+private:
+    std::atomic<std::shared_ptr<const CatalogSnapshot>> current;
+    std::mutex reload_mutex;
+    chrono::steady_clock::time_point next_retry;  // под reload_mutex
+
+    // Под reload_mutex. Версия берётся до запроса, поэтому данные снимка не старше его тега.
+    // При ошибке текущий снимок не трогается.
+    bool reload_locked() {
+        auto snap = std::make_shared<CatalogSnapshot>();
+        snap->version = materials_version.value.load();
+        snap->etag = materials_version.etag();
+
+        PGconn* conn = db_pool->get();
+        if (!conn) {
+            next_retry = chrono::steady_clock::now() + CATALOG_RETRY;
+            return false;
+        }
+        PGresult* r = PQexec(conn, "SELECT id, name, mu0, b, T0, n FROM materials ORDER BY name, id");
+        if (PQresultStatus(r) != PGRES_TUPLES_OK) {
+            std::cerr << "DB ERROR: " << PQerrorMessage(conn) << std::endl;
+            PQclear(r);
+            db_pool->put(conn);
+            next_retry = chrono::steady_clock::now() + CATALOG_RETRY;
+            return false;
+        }
+
+        json arr = json::array();
+        int rows = PQntuples(r);
+        snap->items.reserve(rows);
+        for (int i = 0; i < rows; i++) {
+            Material m{ stoi(PQgetvalue(r, i, 0)), PQgetvalue(r, i, 1),
+                stod(PQgetvalue(r, i, 2)), stod(PQgetvalue(r, i, 3)),
+                stod(PQgetvalue(r, i, 4)), stod(PQgetvalue(r, i, 5)) };
+            arr.push_back({ {"id", m.id}, {"name", m.name}, {"mu0", m.mu0},
+                {"b", m.b}, {"T0", m.T0}, {"n", m.n} });
+            snap->by_id[m.id] = snap->items.size();
+            snap->items.push_back(std::move(m));
+        }
+        PQclear(r);
+        db_pool->put(conn);
+
+        snap->body = arr.dump();
+        current.store(std::move(snap), std::memory_order_release);
+        return true;
+    }
+
+public:
+    std::shared_ptr<const CatalogSnapshot> get() const {
+        return current.load(std::memory_order_acquire);
+    }
+
+    // Перечитывает таблицу (после записи через API и при старте)
+    bool reload() {
+        std::lock_guard<std::mutex> lock(reload_mutex);
+        return reload_locked();
+    }
+
+    // Снимок для чтения. Устаревший снимок отдаётся сразу, а перечитывает его один поток
+    // (остальные не ждут). Если снимка нет совсем, ждём перезагрузку и проверяем снова:
+    // пока один поток читал таблицу, снимок мог уже появиться.
+    std::shared_ptr<const CatalogSnapshot> acquire() {
+        auto snap = get();
+        if (snap && snap->fresh()) return snap;
+        if (snap) {
+            std::unique_lock<std::mutex> lock(reload_mutex, std::try_to_lock);
+            if (lock.owns_lock() && !get()->fresh() && chrono::steady_clock::now() >= next_retry) reload_locked();
+            return get();
+        }
+        std::lock_guard<std::mutex> lock(reload_mutex);
+        if (!get() && chrono::steady_clock::now() >= next_retry) reload_locked();
+        return get();
+    }
+};
+
+MaterialCatalog material_catalog;
+
+// === ПОТОКОВЫЙ ЭКСПОРТ (COPY ... TO STDOUT) ===
+// Соединение занято на всё время выгрузки и возвращается в пул только в releaser'е
+struct CopyExport {
+    PGconn* conn = nullptr;
+    bool finished = false;
+};
+
+const size_t COPY_CHUNK_SIZE = 64 * 1024;
+
+// Приводит соединение в исходное состояние после COPY OUT (в т.ч. прерванного клиентом)
+void finish_copy(PGconn* conn, bool aborted) {
+    if (aborted) {
+        PGcancel* cancel = PQgetCancel(conn);
+        if (cancel) {
+            char errbuf[256];
+            PQcancel(cancel, errbuf, sizeof(errbuf));
+            PQfreeCancel(cancel);
+        }
+        char* buf = nullptr;
+        while (PQgetCopyData(conn, &buf, 0) > 0) PQfreemem(buf);
+    }
+    while (PGresult* r = PQgetResult(conn)) PQclear(r);
+}
+
+// Запускает COPY и отдаёт строки клиенту чанками по COPY_CHUNK_SIZE.
+// Память сервера не зависит от размера таблицы: в буфере максимум один чанк.
+bool stream_copy(const string& query, const char* content_type, httplib::Response& res) {
+    PGconn* conn = db_pool->get();
+    if (!conn) {
+        res.status = 500;
+        res.set_content(json{ {"error", "DB unavailable"} }.dump(), "application/json");
+        return false;
+    }
+
+    PGresult* r = PQexec(conn, query.c_str());
+    if (PQresultStatus(r) != PGRES_COPY_OUT) {
+        std::cerr << "DB ERROR: " << PQerrorMessage(conn) << std::endl;
+        PQclear(r);
+        finish_copy(conn, false);
+        db_pool->put(conn);
+        res.status = 500;
+        res.set_content(json{ {"error", "Query failed"} }.dump(), "application/json");
+        return false;
+    }
+    PQclear(r);
+
+    auto state = std::make_shared<CopyExport>();
+    state->conn = conn;
+
+    res.set_chunked_content_provider(content_type,
+        [state](size_t, httplib::DataSink& sink) {
+            string chunk;
+            chunk.reserve(COPY_CHUNK_SIZE);
+            while (chunk.size() < COPY_CHUNK_SIZE) {
+                char* buf = nullptr;
+                int len = PQgetCopyData(state->conn, &buf, 0);
+                if (len > 0) {
+                    chunk.append(buf, len);
+                    PQfreemem(buf);
+                    continue;
+                }
+
+                // -1: COPY завершён, -2: ошибка соединения
+                state->finished = true;
+                bool ok = len == -1;
+                PGresult* fin = PQgetResult(state->conn);
+                if (PQresultStatus(fin) != PGRES_COMMAND_OK) {
+                    std::cerr << "COPY ERROR: " << PQerrorMessage(state->conn) << std::endl;
+                    ok = false;
+                }
+                PQclear(fin);
+                if (!ok) return false;  // клиент увидит оборванный chunked-ответ
+                if (!chunk.empty() && !sink.write(chunk.data(), chunk.size())) return false;
+                sink.done();
+                return true;
+            }
+            return sink.write(chunk.data(), chunk.size());
+        },
+        [state](bool) {
+            finish_copy(state->conn, !state->finished);
+            db_pool->put(state->conn);
+        });
+    return true;
 }
 
-using namespace std;
-using json = nlohmann::json;
+// === ХЭШИРОВАНИЕ ПАРОЛЕЙ ===
+// PBKDF2-HMAC-SHA256 (OpenSSL). Формат хранения: pbkdf2_sha256$<итерации>$<соль hex>$<хэш hex>.
+// Хэширование дорогое по CPU, поэтому выполняется в отдельном ограниченном пуле потоков:
+// при всплеске входов обработчики HTTP ждут результат не дольше бюджета, а лишние запросы
+// получают 503 вместо того, чтобы занять все ядра.
+// Настройка: EXTRUSION_PBKDF2_ITERATIONS, EXTRUSION_HASH_THREADS, EXTRUSION_HASH_QUEUE,
+// EXTRUSION_HASH_BUDGET_MS.
+const string PBKDF2_PREFIX = "pbkdf2_sha256$";
+
+class PasswordHasher {
+private:
+    struct Job {
+        std::function<void()> work;
+        chrono::steady_clock::time_point enqueued;
+        std::shared_ptr<std::atomic<bool>> abandoned;  // клиент уже получил 503
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Job> queue;
+    vector<std::thread> workers;
+    bool stopping = false;
+
+    int iterations;
+    size_t max_queue;
+    chrono::milliseconds budget;
+    string dummy;  // хэш случайного пароля для проверки при неизвестном логине
+
+    // Метрики
+    std::atomic<uint64_t> submitted{ 0 }, completed{ 0 }, rejected{ 0 }, timed_out{ 0 };
+    std::atomic<uint64_t> wait_us{ 0 }, work_us{ 0 };
+    std::atomic<size_t> peak_depth{ 0 };
+
+    void worker_loop() {
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (stopping && queue.empty()) return;
+                job = std::move(queue.front());
+                queue.pop_front();
+            }
+            auto started = chrono::steady_clock::now();
+            wait_us += chrono::duration_cast<chrono::microseconds>(started - job.enqueued).count();
+            if (job.abandoned && job.abandoned->load()) continue;  // ответ уже ушёл — CPU не тратим
+
+            job.work();
+            work_us += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started).count();
+            completed++;
+        }
+    }
+
+    bool push(Job job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (queue.size() >= max_queue) {
+                rejected++;
+                return false;
+            }
+            queue.push_back(std::move(job));
+            if (queue.size() > peak_depth) peak_depth = queue.size();
+        }
+        submitted++;
+        cv.notify_one();
+        return true;
+    }
+
+    // Выполняет fn в пуле и ждёт результат не дольше бюджета; nullopt — пул перегружен
+    template <class T>
+    std::optional<T> run(std::function<T()> fn) {
+        auto task = std::make_shared<std::packaged_task<T()>>(std::move(fn));
+        auto result = task->get_future();
+        auto abandoned = std::make_shared<std::atomic<bool>>(false);
+        if (!push(Job{ [task] { (*task)(); }, chrono::steady_clock::now(), abandoned })) return std::nullopt;
+
+        if (result.wait_for(budget) != std::future_status::ready) {
+            abandoned->store(true);
+            timed_out++;
+            return std::nullopt;
+        }
+        return result.get();
+    }
+
+    string derive(const string& password, const string& salt, int iter) const {
+        unsigned char out[32];
+        PKCS5_PBKDF2_HMAC(password.data(), static_cast<int>(password.size()),
+            reinterpret_cast<const unsigned char*>(salt.data()), static_cast<int>(salt.size()),
+            iter, EVP_sha256(), sizeof(out), out);
+        return to_hex(out, sizeof(out));
+    }
+
+public:
+    enum class Status { Ok, Busy };
+
+    struct VerifyResult {
+        Status status = Status::Busy;
+        bool match = false;
+        bool needs_rehash = false;  // открытый пароль из старой схемы или устаревшее число итераций
+    };
+
+    PasswordHasher()
+        : iterations(static_cast<int>(env_long("EXTRUSION_PBKDF2_ITERATIONS", 600000))),
+        max_queue(static_cast<size_t>(env_long("EXTRUSION_HASH_QUEUE", 64))),
+        budget(env_long("EXTRUSION_HASH_BUDGET_MS", 3000)) {
+        long threads = env_long("EXTRUSION_HASH_THREADS",
+            std::max(1L, static_cast<long>(std::thread::hardware_concurrency() / 2)));
+        for (long i = 0; i < std::max(1L, threads); i++) {
+            workers.emplace_back([this] { worker_loop(); });
+        }
+        dummy = encode(random_hex(16));
+    }
+
+    ~PasswordHasher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    // Синхронное вычисление хэша — только для заданий, уже выполняющихся в пуле (post)
+    string encode(const string& password) const {
+        string salt = random_hex(16);
+        return PBKDF2_PREFIX + to_string(iterations) + "$" + salt + "$" + derive(password, salt, iterations);
+    }
+
+    // Новый хэш для сохранения в БД; nullopt — пул перегружен
+    std::optional<string> hash(const string& password) {
+        return run<string>([this, password] { return encode(password); });
+    }
+
+    VerifyResult verify(const string& password, const string& stored) {
+        auto result = run<VerifyResult>([this, password, stored] {
+            VerifyResult v;
+            v.status = Status::Ok;
+            // Холостой derive там, где хэш не считается: по времени ответа не отличить открытый
+            // пароль старой схемы или испорченную запись от PBKDF2-учётки
+            auto idle = [&] { derive(password, PBKDF2_PREFIX, iterations); };
+            if (stored.rfind(PBKDF2_PREFIX, 0) != 0) {
+                idle();
+                v.match = stored.size() == password.size() &&
+                    CRYPTO_memcmp(stored.data(), password.data(), stored.size()) == 0;
+                v.needs_rehash = true;
+                return v;
+            }
+            // pbkdf2_sha256$<iter>$<salt>$<hash>
+            size_t p1 = stored.find('$', PBKDF2_PREFIX.size());
+            size_t p2 = p1 == string::npos ? string::npos : stored.find('$', p1 + 1);
+            int iter = 0;
+            if (p2 != string::npos) {
+                try { iter = stoi(stored.substr(PBKDF2_PREFIX.size(), p1 - PBKDF2_PREFIX.size())); }
+                catch (...) {}
+            }
+            if (iter <= 0) {
+                idle();
+                return v;
+            }
+            string salt = stored.substr(p1 + 1, p2 - p1 - 1);
+            string expected = stored.substr(p2 + 1);
+            string actual = derive(password, salt, iter);
+            v.match = actual.size() == expected.size() &&
+                CRYPTO_memcmp(actual.data(), expected.data(), actual.size()) == 0;
+            v.needs_rehash = iter != iterations;
+            return v;
+        });
+        return result ? *result : VerifyResult{};
+    }
+
+    // Та же по стоимости проверка для неизвестного логина: время ответа не выдаёт,
+    // существует ли пользователь. Совпадения не бывает.
+    VerifyResult verify_unknown(const string& password) {
+        VerifyResult v = verify(password, dummy);
+        v.match = false;
+        v.needs_rehash = false;
+        return v;
+    }
+
+    // Фоновое задание без ожидания результата (перехэширование после входа); при переполнении отбрасывается
+    void post(std::function<void()> fn) {
+        push(Job{ std::move(fn), chrono::steady_clock::now(), nullptr });
+    }
+
+    json metrics() {
+        size_t depth;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            depth = queue.size();
+        }
+        uint64_t done = completed.load();
+        return {
+            {"threads", workers.size()},
+            {"iterations", iterations},
+            {"budget_ms", budget.count()},
+            {"queue_depth", depth},
+            {"queue_peak", peak_depth.load()},
+            {"queue_limit", max_queue},
+            {"submitted", submitted.load()},
+            {"completed", done},
+            {"rejected", rejected.load()},
+            {"timed_out", timed_out.load()},
+            {"avg_wait_ms", submitted ? wait_us.load() / 1000.0 / submitted.load() : 0.0},
+            {"avg_hash_ms", done ? work_us.load() / 1000.0 / done : 0.0}
+        };
+    }
+};
+
+std::unique_ptr<PasswordHasher> password_hasher;
+
+// === СЕССИИ ===
+// Токен выдаётся при входе и передаётся в cookie "session" или в заголовке
+// "Authorization: Bearer <token>". Проверка — поиск в хэш-таблице, без обращения к БД.
+// Таблица разбита на шарды со своими мьютексами, чтобы входы не сериализовались на одной блокировке.
+struct Session {
+    string login;
+    string role;
+    chrono::steady_clock::time_point expires;
+};
+
+const chrono::seconds SESSION_TTL = chrono::hours(8);  // смена; продлевается при каждом обращении
+
+class SessionStore {
+private:
+    static const size_t SHARDS = 16;
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<string, Session> sessions;
+    };
+    std::array<Shard, SHARDS> shards;
+
+    Shard& shard_for(const string& token) {
+        return shards[std::hash<string>{}(token) % SHARDS];
+    }
+
+public:
+    string create(const string& login, const string& role) {
+        string token = random_hex(32);
+        auto now = chrono::steady_clock::now();
+        Shard& shard = shard_for(token);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        // Попутно чистим просроченные сессии этого шарда
+        for (auto it = shard.sessions.begin(); it != shard.sessions.end();) {
+            if (it->second.expires <= now) it = shard.sessions.erase(it);
+            else ++it;
+        }
+        shard.sessions[token] = Session{ login, role, now + SESSION_TTL };
+        return token;
+    }
+
+    std::optional<Session> find(const string& token) {
+        if (token.empty()) return std::nullopt;
+        auto now = chrono::steady_clock::now();
+        Shard& shard = shard_for(token);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.sessions.find(token);
+        if (it == shard.sessions.end()) return std::nullopt;
+        if (it->second.expires <= now) {
+            shard.sessions.erase(it);
+            return std::nullopt;
+        }
+        it->second.expires = now + SESSION_TTL;
+        return it->second;
+    }
+
+    void remove(const string& token) {
+        Shard& shard = shard_for(token);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.sessions.erase(token);
+    }
+
+    // Сброс всех сессий пользователя (смена пароля или роли)
+    void remove_login(const string& login) {
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (auto it = shard.sessions.begin(); it != shard.sessions.end();) {
+                if (it->second.login == login) it = shard.sessions.erase(it);
+                else ++it;
+            }
+        }
+    }
+};
+
+SessionStore sessions;
+
+string session_token(const httplib::Request& req) {
+    const string bearer = "Bearer ";
+    string auth = req.get_header_value("Authorization");
+    if (auth.rfind(bearer, 0) == 0) return auth.substr(bearer.size());
+
+    std::stringstream ss(req.get_header_value("Cookie"));
+    string cookie;
+    while (getline(ss, cookie, ';')) {
+        size_t b = cookie.find_first_not_of(' ');
+        if (b != string::npos && cookie.compare(b, 8, "session=") == 0) return cookie.substr(b + 8);
+    }
+    return "";
+}
+
+// Проверяет сессию и роль (nullptr — любая). При отказе формирует 401/403 и возвращает nullopt.
+std::optional<Session> require_session(const httplib::Request& req, httplib::Response& res, const char* role = nullptr) {
+    auto session = sessions.find(session_token(req));
+    if (!session) {
+        res.status = 401;
+        res.set_content(json{ {"error", "Требуется вход"} }.dump(), "application/json");
+        return std::nullopt;
+    }
+    if (role && session->role != role) {
+        res.status = 403;
+        res.set_content(json{ {"error", "Недостаточно прав"} }.dump(), "application/json");
+        return std::nullopt;
+    }
+    return session;
+}
+
+// === ОГРАНИЧЕНИЕ ЧАСТОТЫ ЗАПРОСОВ (token bucket) ===
+// Проверка выполняется в pre-routing обработчике — до обращения к пулу соединений и расчётов.
+// Состояние ведра — один 64-битный атомик: старшие 32 бита — время последнего обновления
+// (мс от старта процесса), младшие 32 — "долг" в тысячных долях токена (0 — ведро полное).
+// Обновление через CAS, без блокировок.
+class TokenBucket {
+private:
+    std::atomic<uint64_t> state{ 0 };
+
+public:
+    // rate — токенов в секунду (то же, что тысячных долей токена в мс), burst — ёмкость ведра.
+    // true — токен выдан; иначе retry_ms — через сколько он появится
+    bool try_take(double rate, double burst, uint32_t now_ms, uint32_t& retry_ms) {
+        const double capacity = burst * 1000.0;
+        uint64_t old = state.load(std::memory_order_relaxed);
+        for (;;) {
+            uint32_t last = static_cast<uint32_t>(old >> 32);
+            double debt = static_cast<double>(static_cast<uint32_t>(old));
+            double elapsed = static_cast<double>(static_cast<uint32_t>(now_ms - last));
+            debt = std::max(0.0, debt - elapsed * rate) + 1000.0;
+            if (debt > capacity) {
+                retry_ms = static_cast<uint32_t>(std::ceil((debt - capacity) / rate));
+                return false;
+            }
+            uint64_t next = (static_cast<uint64_t>(now_ms) << 32) | static_cast<uint32_t>(debt);
+            if (state.compare_exchange_weak(old, next, std::memory_order_relaxed)) return true;
+        }
+    }
+
+    // Возвращает выданный токен, если запрос всё же отклонён другим ведром
+    void give_back() {
+        uint64_t old = state.load(std::memory_order_relaxed);
+        for (;;) {
+            uint32_t debt = static_cast<uint32_t>(old);
+            uint64_t next = (old & 0xFFFFFFFF00000000ull) | (debt > 1000 ? debt - 1000 : 0);
+            if (state.compare_exchange_weak(old, next, std::memory_order_relaxed)) return;
+        }
+    }
+};
+
+struct RateRule {
+    const char* method;
+    const char* prefix;        // префикс пути
+    double client_rate;        // токенов в секунду на клиента
+    double client_burst;
+    double route_rate;         // на маршрут в целом; 0 — без общего лимита
+    double route_burst;
+};
+
+// Первое совпадение по методу и префиксу
+const vector<RateRule> RATE_RULES = {
+    { "POST", "/api/login",     0.5, 10,  20, 50 },
+    { "POST", "/api/calculate", 2,   10,  20, 40 },
+    { "",     "/api/",          20,  50,  0,  0 },
+};
+
+class RateLimiter {
+private:
+    // Ведра клиентов — фиксированная таблица по хэшу ключа: память ограничена, вытеснение не нужно.
+    // Коллизия лишь объединяет двух клиентов в одно ведро.
+    static const size_t CLIENT_SLOTS = 4096;
+
+    struct RuleState {
+        std::unique_ptr<TokenBucket[]> clients{ new TokenBucket[CLIENT_SLOTS] };
+        TokenBucket route;
+        std::atomic<uint64_t> allowed{ 0 }, limited{ 0 };
+    };
+
+    std::unique_ptr<RuleState[]> states{ new RuleState[RATE_RULES.size()] };
+    const chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
+public:
+    // true — запрос пропускается; иначе retry_after_s — значение для Retry-After
+    bool allow(const string& method, const string& path, const string& client, uint32_t& retry_after_s) {
+        for (size_t i = 0; i < RATE_RULES.size(); i++) {
+            const RateRule& rule = RATE_RULES[i];
+            if (*rule.method && method != rule.method) continue;
+            if (path.rfind(rule.prefix, 0) != 0) continue;
+
+            RuleState& st = states[i];
+            uint32_t now_ms = static_cast<uint32_t>(
+                chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count());
+            uint32_t retry_ms = 0;
+            TokenBucket& bucket = st.clients[std::hash<string>{}(client) % CLIENT_SLOTS];
+            bool ok = bucket.try_take(rule.client_rate, rule.client_burst, now_ms, retry_ms);
+            if (ok && rule.route_rate > 0 && !st.route.try_take(rule.route_rate, rule.route_burst, now_ms, retry_ms)) {
+                // Маршрут перегружен не этим клиентом: его бюджет на другие запросы не тратится
+                bucket.give_back();
+                ok = false;
+            }
+            if (!ok) {
+                st.limited++;
+                retry_after_s = std::max<uint32_t>(1, (retry_ms + 999) / 1000);
+                return false;
+            }
+            st.allowed++;
+            return true;
+        }
+        return true;
+    }
+
+    json metrics() const {
+        json arr = json::array();
+        for (size_t i = 0; i < RATE_RULES.size(); i++) {
+            arr.push_back({
+                {"method", RATE_RULES[i].method},
+                {"prefix", RATE_RULES[i].prefix},
+                {"allowed", states[i].allowed.load()},
+                {"limited", states[i].limited.load()}
+                });
+        }
+        return arr;
+    }
+};
+
+RateLimiter rate_limiter;
+
+// === ОЧЕРЕДЬ ЗАДАЧ HTTP (work stealing) ===
+// Замена httplib::ThreadPool с одной общей очередью под одним мьютексом.
+// У каждого потока своя очередь: приём соединений раскладывает задачи по кругу, поток берёт
+// свои задачи с головы, а опустев — ворует с хвоста чужих. Общий мьютекс нужен только
+// для засыпания простаивающих потоков. Очередь ограничена: сверх лимита httplib закрывает соединение.
+// Настройка: EXTRUSION_HTTP_THREADS, EXTRUSION_HTTP_BACKLOG.
+class WorkStealingQueue : public httplib::TaskQueue {
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> jobs;
+        std::atomic<uint64_t> executed{ 0 }, stolen{ 0 };
+    };
+
+    vector<std::unique_ptr<Worker>> workers;
+    vector<std::thread> threads;
+    size_t max_backlog;
+
+    std::atomic<size_t> pending{ 0 };  // поставлено, но ещё не взято в работу
+    std::atomic<size_t> next{ 0 };
+    std::atomic<size_t> idle{ 0 };
+    std::atomic<size_t> peak{ 0 };
+    std::atomic<uint64_t> rejected{ 0 };
+    std::atomic<bool> stopping{ false };
+
+    std::mutex park_mutex;
+    std::condition_variable park_cv;
+
+    bool pop_own(size_t i, std::function<void()>& fn) {
+        Worker& w = *workers[i];
+        std::lock_guard<std::mutex> lock(w.mutex);
+        if (w.jobs.empty()) return false;
+        fn = std::move(w.jobs.front());
+        w.jobs.pop_front();
+        return true;
+    }
+
+    bool steal(size_t i, std::function<void()>& fn) {
+        for (size_t k = 1; k < workers.size(); k++) {
+            Worker& victim = *workers[(i + k) % workers.size()];
+            std::unique_lock<std::mutex> lock(victim.mutex, std::try_to_lock);
+            if (!lock.owns_lock() || victim.jobs.empty()) continue;
+            fn = std::move(victim.jobs.back());
+            victim.jobs.pop_back();
+            workers[i]->stolen++;
+            return true;
+        }
+        return false;
+    }
+
+    void run(size_t i) {
+        for (;;) {
+            std::function<void()> fn;
+            if (pop_own(i, fn) || steal(i, fn)) {
+                pending--;
+                fn();
+                workers[i]->executed++;
+                continue;
+            }
+
+            // pending увеличивается до публикации задачи, а idle — до проверки pending:
+            // либо поток увидит новую задачу, либо постановщик увидит спящий поток и разбудит его
+            std::unique_lock<std::mutex> lock(park_mutex);
+            idle++;
+            park_cv.wait(lock, [&] { return pending.load() > 0 || stopping.load(); });
+            idle--;
+            if (stopping.load() && pending.load() == 0) return;
+        }
+    }
+
+public:
+    WorkStealingQueue(size_t n, size_t backlog) : max_backlog(backlog) {
+        n = std::max<size_t>(1, n);
+        for (size_t i = 0; i < n; i++) workers.push_back(std::make_unique<Worker>());
+        for (size_t i = 0; i < n; i++) threads.emplace_back([this, i] { run(i); });
+    }
+
+    ~WorkStealingQueue() override {
+        if (!stopping.load()) shutdown();
+    }
+
+    bool enqueue(std::function<void()> fn) override {
+        size_t depth = pending.fetch_add(1) + 1;
+        if (max_backlog > 0 && depth > max_backlog) {
+            pending--;
+            rejected++;
+            return false;
+        }
+        size_t prev = peak.load();
+        while (depth > prev && !peak.compare_exchange_weak(prev, depth)) {}
+
+        Worker& w = *workers[next.fetch_add(1) % workers.size()];
+        {
+            std::lock_guard<std::mutex> lock(w.mutex);
+            w.jobs.push_back(std::move(fn));
+        }
+        if (idle.load() > 0) {
+            std::lock_guard<std::mutex> lock(park_mutex);
+            park_cv.notify_one();
+        }
+        return true;
+    }
+
+    void shutdown() override {
+        {
+            std::lock_guard<std::mutex> lock(park_mutex);
+            stopping = true;
+        }
+        park_cv.notify_all();
+        for (auto& t : threads) t.join();
+        threads.clear();
+    }
+
+    json metrics() const {
+        uint64_t executed = 0, stolen = 0;
+        json depths = json::array();
+        for (const auto& w : workers) {
+            executed += w->executed.load();
+            stolen += w->stolen.load();
+            std::lock_guard<std::mutex> lock(w->mutex);
+            depths.push_back(w->jobs.size());
+        }
+        return {
+            {"threads", workers.size()},
+            {"backlog_limit", max_backlog},
+            {"queue_depth", pending.load()},
+            {"queue_peak", peak.load()},
+            {"worker_depths", depths},
+            {"idle", idle.load()},
+            {"executed", executed},
+            {"stolen", stolen},
+            {"rejected", rejected.load()}
+        };
+    }
+};
+
+// Очередь создаётся httplib при listen и им же удаляется; указатель — только для метрик
+std::atomic<WorkStealingQueue*> http_task_queue{ nullptr };
+
+// === СЖАТИЕ ===
+// gzip (zlib) и brotli подключаются макросами EXTRUSION_ZLIB / EXTRUSION_BROTLI;
+// без них ответы отдаются без сжатия. Сжатие httplib (CPPHTTPLIB_*_SUPPORT) не используется,
+// чтобы тела не сжимались повторно.
+enum class Encoding { Identity, Gzip, Brotli };
+
+// Лучшее поддерживаемое кодирование из Accept-Encoding (учитывается q=0)
+Encoding negotiate_encoding(const httplib::Request& req) {
+    bool gzip = false, br = false;
+    std::stringstream ss(req.get_header_value("Accept-Encoding"));
+    string item;
+    while (getline(ss, item, ',')) {
+        size_t semi = item.find(';');
+        string name = item.substr(0, semi);
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        if (semi != string::npos) {
+            string params = item.substr(semi + 1);
+            size_t q = params.find("q=");
+            if (q != string::npos) {
+                try {
+                    if (stod(params.substr(q + 2)) <= 0) continue;
+                }
+                catch (...) {}
+            }
+        }
+        if (name == "gzip") gzip = true;
+        else if (name == "br") br = true;
+    }
+#ifdef EXTRUSION_BROTLI
+    if (br) return Encoding::Brotli;
+#endif
+#ifdef EXTRUSION_ZLIB
+    if (gzip) return Encoding::Gzip;
+#endif
+    (void)gzip;
+    (void)br;
+    return Encoding::Identity;
+}
+
+const char* encoding_name(Encoding e) {
+    switch (e) {
+    case Encoding::Gzip: return "gzip";
+    case Encoding::Brotli: return "br";
+    default: return "identity";
+    }
+}
+
+// Пустая строка — сжатие недоступно или не удалось
+string gzip_compress(const string& data, int level) {
+#ifdef EXTRUSION_ZLIB
+    z_stream zs{};
+    if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return "";
+    string out(deflateBound(&zs, static_cast<uLong>(data.size())), '\0');
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    zs.avail_in = static_cast<uInt>(data.size());
+    zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    zs.avail_out = static_cast<uInt>(out.size());
+    int rc = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return rc == Z_STREAM_END ? out : "";
+#else
+    (void)data;
+    (void)level;
+    return "";
+#endif
+}
+
+string brotli_compress(const string& data, int quality) {
+#ifdef EXTRUSION_BROTLI
+    size_t size = BrotliEncoderMaxCompressedSize(data.size());
+    if (size == 0) return "";
+    string out(size, '\0');
+    if (!BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC, data.size(),
+        reinterpret_cast<const uint8_t*>(data.data()), &size, reinterpret_cast<uint8_t*>(&out[0]))) {
+        return "";
+    }
+    out.resize(size);
+    return out;
+#else
+    (void)data;
+    (void)quality;
+    return "";
+#endif
+}
+
+// --- Сжатие ответов API на лету ---
+// Обёртка classed() пропускает через ResponseCompressor каждый ответ маршрута /api/.
+// Тело сжимается целиком, если оно не меньше порога; потоковые (chunked) ответы кодируются
+// по мере записи — для text/event-stream каждый блок сбрасывается сразу, чтобы события не копились
+// в буфере кодировщика. Уровни ниже, чем у статики: сжатие выполняется на каждый запрос.
+// Настройка: EXTRUSION_COMPRESS_MIN_BYTES (1024), EXTRUSION_GZIP_LEVEL (6), EXTRUSION_BROTLI_QUALITY (5).
+enum class FlushMode { None, Flush, Finish };
+
+class StreamCompressor {
+public:
+    virtual ~StreamCompressor() = default;
+    // Дописывает сжатые данные в out; false — ошибка кодировщика
+    virtual bool write(const char* data, size_t len, FlushMode mode, string& out) = 0;
+};
+
+#ifdef EXTRUSION_ZLIB
+class GzipStream : public StreamCompressor {
+    z_stream zs{};
+    bool ready = false;
+
+public:
+    // window_bits = -15 — «сырой» deflate без заголовка gzip (записи ZIP)
+    explicit GzipStream(int level, int window_bits = 15 + 16) {
+        ready = deflateInit2(&zs, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+    ~GzipStream() override {
+        if (ready) deflateEnd(&zs);
+    }
+
+    bool write(const char* data, size_t len, FlushMode mode, string& out) override {
+        if (!ready) return false;
+        int flush = mode == FlushMode::Finish ? Z_FINISH : mode == FlushMode::Flush ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        zs.avail_in = static_cast<uInt>(len);
+        char buf[16 * 1024];
+        int rc;
+        do {
+            zs.next_out = reinterpret_cast<Bytef*>(buf);
+            zs.avail_out = sizeof(buf);
+            rc = deflate(&zs, flush);
+            if (rc == Z_STREAM_ERROR) return false;
+            out.append(buf, sizeof(buf) - zs.avail_out);
+        } while (zs.avail_out == 0 || (flush == Z_FINISH && rc != Z_STREAM_END));
+        return true;
+    }
+};
+#endif
+
+#ifdef EXTRUSION_BROTLI
+class BrotliStream : public StreamCompressor {
+    BrotliEncoderState* state;
+
+public:
+    explicit BrotliStream(int quality) : state(BrotliEncoderCreateInstance(nullptr, nullptr, nullptr)) {
+        if (state) BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, static_cast<uint32_t>(quality));
+    }
+    ~BrotliStream() override {
+        if (state) BrotliEncoderDestroyInstance(state);
+    }
+
+    bool write(const char* data, size_t len, FlushMode mode, string& out) override {
+        if (!state) return false;
+        BrotliEncoderOperation op = mode == FlushMode::Finish ? BROTLI_OPERATION_FINISH
+            : mode == FlushMode::Flush ? BROTLI_OPERATION_FLUSH : BROTLI_OPERATION_PROCESS;
+        const uint8_t* next_in = reinterpret_cast<const uint8_t*>(data);
+        size_t avail_in = len;
+        uint8_t buf[16 * 1024];
+        while (true) {
+            uint8_t* next_out = buf;
+            size_t avail_out = sizeof(buf);
+            if (!BrotliEncoderCompressStream(state, op, &avail_in, &next_in, &avail_out, &next_out, nullptr)) return false;
+            out.append(reinterpret_cast<const char*>(buf), sizeof(buf) - avail_out);
+            if (avail_in == 0 && !BrotliEncoderHasMoreOutput(state) &&
+                (op != BROTLI_OPERATION_FINISH || BrotliEncoderIsFinished(state))) break;
+        }
+        return true;
+    }
+};
+#endif
+
+class ResponseCompressor {
+    size_t min_bytes;
+    int gzip_level;
+    int brotli_quality;
+
+    std::atomic<uint64_t> responses{ 0 }, streams{ 0 }, gzip_count{ 0 }, brotli_count{ 0 };
+    std::atomic<uint64_t> bytes_in{ 0 }, bytes_out{ 0 }, cpu_us{ 0 };
+
+    static bool compressible(const string& type) {
+        return type.rfind("text/", 0) == 0 || type.rfind("application/json", 0) == 0 ||
+            type.rfind("application/x-ndjson", 0) == 0;
+    }
+
+    std::unique_ptr<StreamCompressor> make(Encoding enc) const {
+#ifdef EXTRUSION_BROTLI
+        if (enc == Encoding::Brotli) return std::make_unique<BrotliStream>(brotli_quality);
+#endif
+#ifdef EXTRUSION_ZLIB
+        if (enc == Encoding::Gzip) return std::make_unique<GzipStream>(gzip_level);
+#endif
+        (void)enc;
+        return nullptr;
+    }
+
+    // Сжатие с учётом объёма и времени кодировщика (без времени отправки клиенту)
+    bool encode(StreamCompressor& c, const char* data, size_t len, FlushMode mode, string& out) {
+        auto started = chrono::steady_clock::now();
+        size_t before = out.size();
+        bool ok = c.write(data, len, mode, out);
+        cpu_us.fetch_add(static_cast<uint64_t>(chrono::duration_cast<chrono::microseconds>(
+            chrono::steady_clock::now() - started).count()));
+        bytes_in.fetch_add(len);
+        bytes_out.fetch_add(out.size() - before);
+        return ok;
+    }
+
+    // Разные представления не должны делить сильный ETag; etag_matches префикс W/ игнорирует
+    static void weaken_etag(httplib::Response& res) {
+        if (!res.has_header("ETag")) return;
+        string etag = res.get_header_value("ETag");
+        if (etag.rfind("W/", 0) == 0) return;
+        res.headers.erase("ETag");  // set_header добавляет, а не заменяет
+        res.set_header("ETag", "W/" + etag);
+    }
+
+    void mark(httplib::Response& res, Encoding enc) {
+        weaken_etag(res);
+        res.set_header("Content-Encoding", encoding_name(enc));
+        (enc == Encoding::Brotli ? brotli_count : gzip_count).fetch_add(1);
+    }
+
+public:
+    ResponseCompressor()
+        : min_bytes(static_cast<size_t>(std::max(0L, env_long("EXTRUSION_COMPRESS_MIN_BYTES", 1024)))),
+        gzip_level(static_cast<int>(std::clamp(env_long("EXTRUSION_GZIP_LEVEL", 6), 1L, 9L))),
+        brotli_quality(static_cast<int>(std::clamp(env_long("EXTRUSION_BROTLI_QUALITY", 5), 0L, 11L))) {}
+
+    int deflate_level() const { return gzip_level; }
+
+    void apply(const httplib::Request& req, httplib::Response& res) {
+        if (res.status == 204 || res.status == 206 || res.status == 304) return;
+        if (res.has_header("Content-Encoding") || !req.ranges.empty()) return;
+        string type = res.get_header_value("Content-Type");
+        if (!compressible(type)) return;
+
+        // Провайдер с известной длиной сжать нельзя: Content-Length уже обещан клиенту
+        bool streamed = res.content_provider_ && res.is_chunked_content_provider_;
+        if (!streamed && (res.content_provider_ || res.body.size() < min_bytes)) return;
+        // Файл (set_file_content) httplib отдаёт сам после обработчика, тела здесь ещё нет
+        if (!streamed && (res.body.empty() || !res.file_content_path_.empty())) return;
+        res.set_header("Vary", "Accept-Encoding");
+
+        Encoding enc = negotiate_encoding(req);
+        std::shared_ptr<StreamCompressor> comp = make(enc);
+        if (!comp) return;
+
+        if (!streamed) {
+            string out;
+            out.reserve(res.body.size() / 4);
+            if (!encode(*comp, res.body.data(), res.body.size(), FlushMode::Finish, out)) return;
+            res.body = std::move(out);
+            responses.fetch_add(1);
+            mark(res, enc);
+            return;
+        }
+
+        // Поля провайдера в httplib открыты; оборачиваем его, подменяя DataSink
+        FlushMode mode = type.rfind("text/event-stream", 0) == 0 ? FlushMode::Flush : FlushMode::None;
+        res.content_provider_ = [this, comp, mode, provider = std::move(res.content_provider_)](
+            size_t offset, size_t length, httplib::DataSink& sink) {
+            bool failed = false;
+            string out;
+            auto send = [&](const char* data, size_t len, FlushMode m) {
+                out.clear();
+                if (!encode(*comp, data, len, m, out)) {
+                    failed = true;
+                    return false;
+                }
+                return out.empty() || sink.write(out.data(), out.size());
+            };
+
+            httplib::DataSink proxy;
+            proxy.is_writable = [&sink] { return sink.is_writable(); };
+            proxy.write = [&](const char* data, size_t len) { return send(data, len, mode); };
+            proxy.done = [&] {
+                if (send(nullptr, 0, FlushMode::Finish)) sink.done();
+            };
+            proxy.done_with_trailer = [&](const httplib::Headers& trailer) {
+                if (send(nullptr, 0, FlushMode::Finish)) sink.done_with_trailer(trailer);
+            };
+            return provider(offset, length, proxy) && !failed;
+        };
+        streams.fetch_add(1);
+        mark(res, enc);
+    }
+
+    json metrics() const {
+        uint64_t in = bytes_in.load(), out = bytes_out.load(), us = cpu_us.load();
+        return {
+            {"min_bytes", min_bytes},
+            {"gzip_level", gzip_level},
+            {"brotli_quality", brotli_quality},
+            {"responses", responses.load()},
+            {"streams", streams.load()},
+            {"gzip", gzip_count.load()},
+            {"br", brotli_count.load()},
+            {"bytes_in", in},
+            {"bytes_out", out},
+            {"ratio", in ? static_cast<double>(out) / in : 0.0},
+            {"cpu_ms", us / 1000.0},
+            {"mb_per_cpu_s", us ? in / 1048576.0 / (us / 1e6) : 0.0}
+        };
+    }
+};
+
+std::unique_ptr<ResponseCompressor> response_compressor;
+
+// === КЛАССЫ ПРИОРИТЕТА ЗАПРОСОВ ===
+// Маршрут известен только после разбора запроса, поэтому приоритет применяется на входе
+// в обработчик: у каждого класса свой лимит одновременных запросов и своя очередь ожидания.
+// Освободившееся место получает класс с более высоким приоритетом, поэтому вход и CRUD
+// не стоят за длинными расчётами. Очереди ограничены по длине и времени ожидания —
+// сверх этого 503, чтобы ожидающие тяжёлые запросы не заняли все потоки HTTP.
+enum class ReqClass { Interactive = 0, Catalog = 1, Heavy = 2 };
+
+class RequestScheduler {
+private:
+    static const size_t CLASSES = 3;
+
+    struct ClassState {
+        const char* name;
+        size_t limit;
+        size_t max_waiting;
+        chrono::milliseconds max_wait;
+        size_t active = 0;
+        std::deque<uint64_t> waiting;  // билеты в порядке прихода
+        std::condition_variable cv;
+        uint64_t admitted = 0, rejected = 0, timed_out = 0, wait_us = 0;
+    };
+
+    std::mutex mutex;
+    std::array<ClassState, CLASSES> classes;
+    size_t total_limit;
+    size_t total_active = 0;
+    uint64_t next_ticket = 0;
+
+    bool has_room(size_t c) const {
+        return classes[c].active < classes[c].limit && total_active < total_limit;
+    }
+
+    // Есть ожидающий более приоритетного класса, которому свободное место тоже подходит
+    bool higher_waiting(size_t c) const {
+        for (size_t h = 0; h < c; h++) {
+            if (!classes[h].waiting.empty() && has_room(h)) return true;
+        }
+        return false;
+    }
+
+    // Билет первый в очереди своего класса и место ему никто не перебивает
+    bool can_admit(size_t c, uint64_t ticket) const {
+        return has_room(c) && classes[c].waiting.front() == ticket && !higher_waiting(c);
+    }
+
+    void wake_all() {
+        for (auto& cls : classes) cls.cv.notify_all();
+    }
+
+public:
+    class Admission {
+    private:
+        RequestScheduler* owner;
+        size_t cls;
+
+    public:
+        Admission(RequestScheduler* o, size_t c) : owner(o), cls(c) {}
+        Admission(const Admission&) = delete;
+        Admission& operator=(const Admission&) = delete;
+        ~Admission() { owner->release(cls); }
+    };
+
+    // Лимиты считаются от числа потоков HTTP. Ожидающий запрос тоже занимает поток, поэтому
+    // активные и ожидающие тяжёлые запросы и запросы каталога вместе получают не больше n − 1
+    // потоков: четверть бюджета на активные тяжёлые, четверть на их очередь, остаток — каталогу
+    // (две трети на активные, треть на очередь). Для входа и CRUD всегда остаётся поток
+    // (при n ≥ 4; main задаёт не меньше 4)
+    explicit RequestScheduler(size_t http_threads) : total_limit(std::max<size_t>(1, http_threads)) {
+        size_t n = total_limit;
+        size_t budget = n - 1;
+        size_t heavy = std::max<size_t>(1, budget / 4);
+        size_t rest = budget > 2 * heavy ? budget - 2 * heavy : 0;
+        size_t catalog = std::max<size_t>(1, rest * 2 / 3);
+        classes[0].name = "interactive";
+        classes[0].limit = n;
+        classes[0].max_waiting = n;
+        classes[0].max_wait = chrono::milliseconds(2000);
+        classes[1].name = "catalog";
+        classes[1].limit = catalog;
+        classes[1].max_waiting = rest > catalog ? rest - catalog : 0;
+        classes[1].max_wait = chrono::milliseconds(5000);
+        classes[2].name = "heavy";
+        classes[2].limit = heavy;
+        classes[2].max_waiting = heavy;
+        classes[2].max_wait = chrono::milliseconds(30000);
+    }
+
+    // nullptr — очередь класса переполнена или ожидание истекло
+    std::unique_ptr<Admission> admit(ReqClass rc) {
+        size_t c = static_cast<size_t>(rc);
+        ClassState& cls = classes[c];
+        auto started = chrono::steady_clock::now();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if (cls.waiting.empty() && has_room(c) && !higher_waiting(c)) {
+            cls.active++;
+            total_active++;
+            cls.admitted++;
+            return std::make_unique<Admission>(this, c);
+        }
+        if (cls.waiting.size() >= cls.max_waiting) {
+            cls.rejected++;
+            return nullptr;
+        }
+
+        uint64_t ticket = next_ticket++;
+        cls.waiting.push_back(ticket);
+        bool ok = cls.cv.wait_until(lock, started + cls.max_wait, [&] { return can_admit(c, ticket); });
+        cls.waiting.erase(std::find(cls.waiting.begin(), cls.waiting.end(), ticket));
+        if (!ok) {
+            cls.timed_out++;
+            wake_all();  // следующий в очереди мог ждать только нас
+            return nullptr;
+        }
+        cls.active++;
+        total_active++;
+        cls.admitted++;
+        cls.wait_us += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started).count();
+        wake_all();
+        return std::make_unique<Admission>(this, c);
+    }
+
+    void release(size_t c) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            classes[c].active--;
+            total_active--;
+        }
+        wake_all();
+    }
+
+    json metrics() {
+        std::lock_guard<std::mutex> lock(mutex);
+        json m = json::object();
+        for (const auto& cls : classes) {
+            m[cls.name] = {
+                {"limit", cls.limit},
+                {"active", cls.active},
+                {"waiting", cls.waiting.size()},
+                {"admitted", cls.admitted},
+                {"rejected", cls.rejected},
+                {"timed_out", cls.timed_out},
+                {"avg_wait_ms", cls.admitted ? cls.wait_us / 1000.0 / cls.admitted : 0.0}
+            };
+        }
+        return m;
+    }
+};
+
+std::unique_ptr<RequestScheduler> request_scheduler;
+
+// Потоковый ответ (content provider) httplib отдаёт уже после возврата из обработчика, и
+// работа провайдера (расчёт, ZIP, COPY) тоже должна считаться в лимите класса. Допуск
+// переезжает в releaser провайдера: httplib вызывает его из деструктора Response, когда
+// отдача закончена или оборвана. Файлы (set_file_content) отдаются без удержания места.
+void hold_until_sent(httplib::Response& res, std::unique_ptr<RequestScheduler::Admission> admission) {
+    if (!res.content_provider_) return;
+    std::shared_ptr<RequestScheduler::Admission> held = std::move(admission);
+    res.content_provider_resource_releaser_ =
+        [held, releaser = std::move(res.content_provider_resource_releaser_)](bool success) {
+        if (releaser) releaser(success);
+    };
+}
+
+// Обёртка маршрута: обработчик выполняется только после допуска в свой класс.
+// Место освобождается по завершении ответа (для потоковых — см. hold_until_sent).
+// Готовый ответ сжимается по Accept-Encoding (см. ResponseCompressor).
+httplib::Server::Handler classed(ReqClass rc, httplib::Server::Handler handler) {
+    return [rc, handler = std::move(handler)](const httplib::Request& req, httplib::Response& res) {
+        auto admission = request_scheduler->admit(rc);
+        if (!admission) {
+            res.status = 503;
+            res.set_header("Retry-After", "1");
+            res.set_content(json{ {"error", "Сервер перегружен, повторите запрос"} }.dump(), "application/json");
+            return;
+        }
+        handler(req, res);
+        response_compressor->apply(req, res);
+        hold_until_sent(res, std::move(admission));
+    };
+}
+
+// То же для маршрутов, читающих тело потоком (ContentReader). При отказе тело не читается:
+// ответ с кодом ошибки httplib отправляет с Connection: close.
+httplib::Server::HandlerWithContentReader classed(ReqClass rc, httplib::Server::HandlerWithContentReader handler) {
+    return [rc, handler = std::move(handler)](const httplib::Request& req, httplib::Response& res,
+        const httplib::ContentReader& reader) {
+        auto admission = request_scheduler->admit(rc);
+        if (!admission) {
+            res.status = 503;
+            res.set_header("Retry-After", "1");
+            res.set_content(json{ {"error", "Сервер перегружен, повторите запрос"} }.dump(), "application/json");
+            return;
+        }
+        handler(req, res, reader);
+        response_compressor->apply(req, res);
+        hold_until_sent(res, std::move(admission));
+    };
+}
+
+// === РАЗБОР ТЕЛ ЗАПРОСОВ (SAX) ===
+// Тело POST разбирается SAX-интерфейсом nlohmann прямо в поля структуры, DOM не строится.
+// Принимается только плоский объект с ключами из таблицы FIELDS структуры. Неизвестный или
+// повторный ключ, вложенный объект или массив, неверный тип и слишком длинная строка прерывают
+// разбор на первом же токене. Отсутствующие поля остаются со значениями по умолчанию.
+// Пакетные запросы (read_body_list) — массив таких объектов верхнего уровня.
+const size_t REQUEST_BODY_MAX = 4096;
+const size_t REQUEST_STRING_MAX = 255;  // совпадает с VARCHAR(255) в БД
+
+template <class T>
+struct BodyField {
+    const char* name;
+    std::variant<int T::*, double T::*, string T::*> target;
+};
+
+template <class T>
+class BodyDecoder : public nlohmann::json_sax<json> {
+    T* out;
+    std::vector<T>* items = nullptr;  // режим списка: каждый объект массива — новый элемент
+    size_t items_max = 0;
+    bool in_array = false;
+    std::span<const BodyField<T>> fields;
+    const BodyField<T>* current = nullptr;
+    uint64_t seen = 0;
+    int depth = 0;
+
+    bool fail(const char* what) {
+        error = std::string(what) + (current ? std::string(": ") + current->name : "");
+        return false;
+    }
+
+    // Числа приходят как целые или дробные; целое поле принимает только целое в пределах int
+    template <class V>
+    bool set_number(V v, bool integral) {
+        if (!current || depth != 1) return fail("Unexpected value");
+        if (auto p = std::get_if<double T::*>(&current->target)) out->*(*p) = static_cast<double>(v);
+        else if (auto q = std::get_if<int T::*>(&current->target)) {
+            if (!integral || v < std::numeric_limits<int>::min() || v > std::numeric_limits<int>::max())
+                return fail("Invalid value");
+            out->*(*q) = static_cast<int>(v);
+        }
+        else return fail("Invalid type");
+        current = nullptr;
+        return true;
+    }
+
+public:
+    std::string error;  // string() ниже — обработчик SAX, поэтому тип с std::
+
+    BodyDecoder(T& o, std::span<const BodyField<T>> f) : out(&o), fields(f) {}
+    BodyDecoder(std::vector<T>& list, size_t max, std::span<const BodyField<T>> f)
+        : out(nullptr), items(&list), items_max(max), fields(f) {}
+
+    bool null() override { return fail("Invalid type"); }
+    bool boolean(bool) override { return fail("Invalid type"); }
+    bool number_integer(number_integer_t v) override { return set_number(v, true); }
+    bool number_unsigned(number_unsigned_t v) override {
+        return set_number(static_cast<number_integer_t>(
+            std::min<number_unsigned_t>(v, std::numeric_limits<number_integer_t>::max())), true);
+    }
+    bool number_float(number_float_t v, const string_t&) override { return set_number(v, false); }
+    bool binary(binary_t&) override { return fail("Invalid type"); }
+
+    bool string(string_t& v) override {
+        if (!current || depth != 1) return fail("Unexpected value");
+        auto p = std::get_if<std::string T::*>(&current->target);
+        if (!p) return fail("Invalid type");
+        if (v.size() > REQUEST_STRING_MAX) return fail("Field too long");
+        out->*(*p) = std::move(v);  // буфер лексера больше не нужен
+        current = nullptr;
+        return true;
+    }
+
+    bool key(string_t& k) override {
+        for (size_t i = 0; i < fields.size(); i++) {
+            if (k != fields[i].name) continue;
+            current = &fields[i];
+            if (seen & (1ull << i)) return fail("Duplicate field");
+            seen |= 1ull << i;
+            return true;
+        }
+        error = "Unknown field: " + k.substr(0, 64);
+        return false;
+    }
+
+    bool start_object(std::size_t) override {
+        if (depth++ != 0) return fail("Nested objects are not allowed");
+        if (items) {
+            if (!in_array) return fail("Array expected");
+            if (items->size() == items_max) return fail("Too many items");
+            out = &items->emplace_back();
+            seen = 0;
+        }
+        return true;
+    }
+    bool end_object() override {
+        depth--;
+        return true;
+    }
+    bool start_array(std::size_t) override {
+        if (!items || in_array || depth != 0) return fail("Arrays are not allowed");
+        in_array = true;
+        return true;
+    }
+    bool end_array() override { return true; }
+
+    bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception&) override {
+        error = "Invalid JSON";
+        return false;
+    }
+};
+
+// Заполняет out из тела запроса; при ошибке ответ 400/413 уже сформирован
+template <class T>
+bool read_body(const httplib::Request& req, httplib::Response& res, T& out) {
+    if (req.body.size() > REQUEST_BODY_MAX) {
+        res.status = 413;
+        res.set_content(json{ {"error", "Request too large"} }.dump(), "application/json");
+        return false;
+    }
+    BodyDecoder<T> decoder(out, T::FIELDS);
+    if (json::sax_parse(req.body, &decoder) && decoder.error.empty()) return true;
+    res.status = 400;
+    res.set_content(json{ {"error", decoder.error.empty() ? "Invalid JSON" : decoder.error} }.dump(), "application/json");
+    return false;
+}
+
+// Массив объектов T (не больше max); пустой массив — ошибка 400
+template <class T>
+bool read_body_list(const httplib::Request& req, httplib::Response& res, vector<T>& out, size_t max) {
+    if (req.body.size() > REQUEST_BODY_MAX * max) {
+        res.status = 413;
+        res.set_content(json{ {"error", "Request too large"} }.dump(), "application/json");
+        return false;
+    }
+    BodyDecoder<T> decoder(out, max, T::FIELDS);
+    if (json::sax_parse(req.body, &decoder) && decoder.error.empty()) {
+        if (!out.empty()) return true;
+        decoder.error = "Empty list";
+    }
+    res.status = 400;
+    res.set_content(json{ {"error", decoder.error.empty() ? "Invalid JSON" : decoder.error} }.dump(), "application/json");
+    return false;
+}
+
+// То же по параметрам строки запроса (GET, EventSource): таблица FIELDS общая с телом.
+// Значение должно разбираться целиком; неизвестные и повторные параметры отклоняются.
+template <class T>
+bool read_query(const httplib::Request& req, httplib::Response& res, T& out) {
+    string error;
+    uint64_t seen = 0;
+    for (const auto& [name, text] : req.params) {
+        size_t i = 0;
+        while (i < T::FIELDS.size() && name != T::FIELDS[i].name) i++;
+        if (i == T::FIELDS.size()) error = "Unknown field: " + name.substr(0, 64);
+        else if (seen & (1ull << i)) error = "Duplicate field: " + name;
+        else {
+            seen |= 1ull << i;
+            const char* first = text.data();
+            const char* last = first + text.size();
+            std::from_chars_result r{ first, std::errc::invalid_argument };
+            const auto& target = T::FIELDS[i].target;
+            if (auto p = std::get_if<int T::*>(&target)) r = std::from_chars(first, last, out.*(*p));
+            else if (auto q = std::get_if<double T::*>(&target)) r = std::from_chars(first, last, out.*(*q));
+            else if (auto t = std::get_if<string T::*>(&target); t && text.size() <= REQUEST_STRING_MAX) {
+                out.*(*t) = text;
+                continue;
+            }
+            if (r.ec != std::errc() || r.ptr != last) error = "Invalid value: " + name;
+        }
+        if (!error.empty()) break;
+    }
+    if (error.empty()) return true;
+    res.status = 400;
+    res.set_content(json{ {"error", error} }.dump(), "application/json");
+    return false;
+}
+
+struct LoginRequest {
+    string login, password;
+    static const std::array<BodyField<LoginRequest>, 2> FIELDS;
+};
+const std::array<BodyField<LoginRequest>, 2> LoginRequest::FIELDS = { {
+    {"login", &LoginRequest::login}, {"password", &LoginRequest::password}
+} };
+
+// Пустой пароль — меняется только роль
+struct UserRequest {
+    string login, password, role;
+    static const std::array<BodyField<UserRequest>, 3> FIELDS;
+};
+const std::array<BodyField<UserRequest>, 3> UserRequest::FIELDS = { {
+    {"login", &UserRequest::login}, {"password", &UserRequest::password}, {"role", &UserRequest::role}
+} };
+
+struct MaterialRequest {
+    string name;
+    double mu0 = 0, b = 0, T0 = 0, n = 0;
+    static const std::array<BodyField<MaterialRequest>, 5> FIELDS;
+};
+const std::array<BodyField<MaterialRequest>, 5> MaterialRequest::FIELDS = { {
+    {"name", &MaterialRequest::name}, {"mu0", &MaterialRequest::mu0}, {"b", &MaterialRequest::b},
+    {"T0", &MaterialRequest::T0}, {"n", &MaterialRequest::n}
+} };
+
+// === ВЕКТОРНЫЕ exp И pow ===
+// exp и pow из libm компилятор не векторизует, поэтому для сеток и точек используются свои:
+// exp — приведение к 2^k · e^r, |r| ≤ ln2/2, и ряд Тейлора до r^13; log — разложение fdlibm
+// (x = 2^k · (1 + f), log(1 + f) через s = f/(2 + f)); pow(x, y) = exp(y · log x).
+// В ядрах только арифметика и операции с битами, без вызовов и ветвлений, поэтому циклы по
+// блокам векторизуются (GCC с -O3, MSVC с /O2). Погрешность exp и log — до 1 ulp, pow — до
+// ~8 ulp от libm. Значения вне быстрой области (|аргумент exp| > 708, x pow не нормальное
+// положительное число, NaN, ∞) пересчитываются вторым проходом через std::exp и std::pow.
+// Скалярные exp_fast и pow_fast дают те же биты, что и блоки, поэтому /api/calculate,
+// сравнение и расчёт по точкам совпадают в узлах сетки.
+const double EXP_FAST_MAX = 708.0;
+const double LN2_HI = 6.93147180369123816490e-01;  // ln 2 = LN2_HI + LN2_LO, k · LN2_HI точно
+const double LN2_LO = 1.90821492927058770002e-10;
+
+inline double exp_core(double x) {
+    const double SHIFT = 0x1.8p52;  // k — целое в младших битах kd
+    double kd = x * 1.4426950408889634 + SHIFT;
+    double k = kd - SHIFT;
+    double r = (x - k * LN2_HI) - k * LN2_LO;
+    double e = 1.0 / 6227020800.0;
+    e = e * r + 1.0 / 479001600.0;
+    e = e * r + 1.0 / 39916800.0;
+    e = e * r + 1.0 / 3628800.0;
+    e = e * r + 1.0 / 362880.0;
+    e = e * r + 1.0 / 40320.0;
+    e = e * r + 1.0 / 5040.0;
+    e = e * r + 1.0 / 720.0;
+    e = e * r + 1.0 / 120.0;
+    e = e * r + 1.0 / 24.0;
+    e = e * r + 1.0 / 6.0;
+    e = e * r + 0.5;
+    e = e * r + 1.0;
+    e = e * r + 1.0;
+    uint64_t scale = (std::bit_cast<uint64_t>(kd) - std::bit_cast<uint64_t>(SHIFT)) << 52;
+    return std::bit_cast<double>(std::bit_cast<uint64_t>(e) + scale);
+}
+
+// Для нормальных положительных x
+inline double log_core(double x) {
+    uint64_t ix = std::bit_cast<uint64_t>(x);
+    uint64_t eb = (ix + 0x00095f619980c433ull) >> 52;  // смещённый порядок, мантисса в [√½, √2)
+    double f = std::bit_cast<double>(ix - ((eb - 1023) << 52)) - 1.0;
+    double k = std::bit_cast<double>(eb | 0x4330000000000000ull) - (0x1p52 + 1023.0);
+    double s = f / (2.0 + f);
+    double z = s * s, w = z * z;
+    double t1 = w * (3.999999999940941908e-01 + w * (2.222219843214978396e-01 + w * 1.531383769920937332e-01));
+    double t2 = z * (6.666666666666735130e-01 + w * (2.857142874366239149e-01 +
+        w * (1.818357216161805012e-01 + w * 1.479819860511658591e-01)));
+    double hfsq = 0.5 * f * f;
+    return k * LN2_HI - ((hfsq - (s * (hfsq + t1 + t2) + k * LN2_LO)) - f);
+}
+
+inline bool pow_fast_domain(double x, double l) {
+    return x >= std::numeric_limits<double>::min() && x <= std::numeric_limits<double>::max() &&
+        std::fabs(l) <= EXP_FAST_MAX;
+}
+
+inline double exp_fast(double x) {
+    return std::fabs(x) <= EXP_FAST_MAX ? exp_core(x) : std::exp(x);
+}
+
+inline double pow_fast(double x, double y) {
+    double l = y * log_core(x);
+    return pow_fast_domain(x, l) ? exp_core(l) : std::pow(x, y);
+}
+
+// out[i] = exp(x[i]); x и out не пересекаются
+void exp_block(const double* x, double* out, size_t n) {
+    for (size_t i = 0; i < n; i++) out[i] = exp_core(x[i]);
+    for (size_t i = 0; i < n; i++) {
+        if (!(std::fabs(x[i]) <= EXP_FAST_MAX)) out[i] = std::exp(x[i]);
+    }
+}
+
+// out[i] = x[i]^y; x и out не пересекаются
+void pow_block(const double* x, double y, double* out, size_t n) {
+    vector<double> l(n);
+    for (size_t i = 0; i < n; i++) l[i] = y * log_core(x[i]);
+    for (size_t i = 0; i < n; i++) out[i] = exp_core(l[i]);
+    for (size_t i = 0; i < n; i++) {
+        if (!pow_fast_domain(x[i], l[i])) out[i] = std::pow(x[i], y);
+    }
+}
+
+// === РАСЧЁТ ВЯЗКОСТИ ===
+// μ(T, γ̇) = μ0 · exp(b · (T0 − Tk) / Tk) · γ̇^(n − 1),  Tk = T + 273.15
+struct CalcRequest {
+    int materialId = 0;
+    double minT = 0, maxT = 0, deltaT = 0;
+    double minG = 0, maxG = 0, deltaG = 0;
+
+    bool valid() const {
+        return !(minT < 100 || maxT > 250 || minT >= maxT || deltaT <= 0 ||
+            minG < 1 || maxG > 1000 || minG >= maxG || deltaG <= 0);
+    }
+
+    static const std::array<BodyField<CalcRequest>, 7> FIELDS;
+};
+const std::array<BodyField<CalcRequest>, 7> CalcRequest::FIELDS = { {
+    {"materialId", &CalcRequest::materialId},
+    {"minT", &CalcRequest::minT}, {"maxT", &CalcRequest::maxT}, {"deltaT", &CalcRequest::deltaT},
+    {"minGamma", &CalcRequest::minG}, {"maxGamma", &CalcRequest::maxG}, {"deltaGamma", &CalcRequest::deltaG}
+} };
+
+struct CalcResult {
+    vector<double> T_vals, G_vals;
+    vector<double> T_points, G_points;  // мин, середина, макс
+    vector<double> mu_T;                // G_points.size() × T_vals.size()
+    vector<double> mu_gamma;            // T_points.size() × G_vals.size()
+    vector<double> table;               // T_vals.size() × G_vals.size(), по строкам T
+    double time_ms = 0;
+};
+
+// Температурный множитель не зависит от γ̇, а степенной — от T, поэтому exp и pow
+// считаются один раз на узел оси, а сетка заполняется только умножениями
+inline double temp_arg(const Material& m, double t) {
+    double temp_k = t + 273.15;
+    return m.b * (m.T0 - temp_k) / temp_k;
+}
+
+inline double temp_factor(const Material& m, double t) {
+    return exp_fast(temp_arg(m, t));
+}
+
+inline double shear_factor(const Material& m, double g) {
+    return pow_fast(g, m.n - 1.0);
+}
+
+vector<double> make_axis(double from, double to, double step) {
+    vector<double> axis;
+    for (double v = from; v <= to + 1e-6; v += step) axis.push_back(v);
+    return axis;
+}
+
+// Оси зависят только от диапазонов и шагов, а не от материала: пакетный расчёт строит их
+// один раз на набор диапазонов
+struct GridAxes {
+    vector<double> T_vals, G_vals;
+};
+
+GridAxes make_axes(const CalcRequest& p) {
+    return { make_axis(p.minT, p.maxT, p.deltaT), make_axis(p.minG, p.maxG, p.deltaG) };
+}
+
+// Оси сетки и множители узлов. Строки таблицы по ним считаются независимо друг от друга,
+// поэтому их можно заполнять частями.
+struct GridPlan {
+    vector<double> T_vals, G_vals;
+    vector<double> exp_T, pow_G;
+};
+
+GridPlan plan_grid(const Material& m, const GridAxes& axes) {
+    GridPlan g;
+    g.T_vals = axes.T_vals;
+    g.G_vals = axes.G_vals;
+    vector<double> args(g.T_vals.size());
+    for (size_t i = 0; i < args.size(); i++) args[i] = temp_arg(m, g.T_vals[i]);
+    g.exp_T.resize(args.size());
+    exp_block(args.data(), g.exp_T.data(), args.size());
+    g.pow_G.resize(g.G_vals.size());
+    pow_block(g.G_vals.data(), m.n - 1.0, g.pow_G.data(), g.G_vals.size());
+    return g;
+}
+
+GridPlan plan_grid(const Material& m, const CalcRequest& p) {
+    return plan_grid(m, make_axes(p));
+}
+
+// Опорные точки кривых: минимум, середина и максимум диапазона
+void curve_points(const CalcRequest& p, CalcResult& r) {
+    r.T_points = { p.minT, (p.minT + p.maxT) / 2.0, p.maxT };
+    r.G_points = { p.minG, (p.minG + p.maxG) / 2.0, p.maxG };
+}
+
+// Кривые mu_T (G_points → T_range) и mu_gamma (T_points → gamma_range)
+void compute_curves(const Material& m, const CalcRequest& p, const GridPlan& g, CalcResult& r) {
+    curve_points(p, r);
+
+    r.mu_T.clear();
+    r.mu_T.reserve(r.G_points.size() * g.T_vals.size());
+    for (double gp : r.G_points) {
+        double power_part = shear_factor(m, gp);
+        for (double exp_part : g.exp_T) r.mu_T.push_back(m.mu0 * exp_part * power_part);
+    }
+
+    r.mu_gamma.clear();
+    r.mu_gamma.reserve(r.T_points.size() * g.G_vals.size());
+    for (double t : r.T_points) {
+        double exp_part = temp_factor(m, t);
+        for (double power_part : g.pow_G) r.mu_gamma.push_back(m.mu0 * exp_part * power_part);
+    }
+}
+
+// Строки таблицы [from, to) — все T × все γ̇; out указывает на строку from
+void fill_rows(const Material& m, const GridPlan& g, size_t from, size_t to, double* out) {
+    size_t nG = g.G_vals.size();
+    for (size_t i = from; i < to; i++, out += nG) {
+        for (size_t k = 0; k < nG; k++) out[k] = m.mu0 * g.exp_T[i] * g.pow_G[k];
+    }
+}
+
+CalcResult compute_grid(const Material& m, const CalcRequest& p, const GridAxes& axes) {
+    auto start = chrono::high_resolution_clock::now();
+
+    GridPlan g = plan_grid(m, axes);
+    CalcResult r;
+    compute_curves(m, p, g, r);
+    r.table.resize(g.T_vals.size() * g.G_vals.size());
+    fill_rows(m, g, 0, g.T_vals.size(), r.table.data());
+    r.T_vals = std::move(g.T_vals);
+    r.G_vals = std::move(g.G_vals);
+
+    r.time_ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+    return r;
+}
+
+CalcResult compute_grid(const Material& m, const CalcRequest& p) {
+    return compute_grid(m, p, make_axes(p));
+}
+
+// Ключи mu_table — значения осей с одним знаком, как их строит интерфейс (toFixed(1)).
+// При шаге меньше 0.05 соседние узлы дают одинаковый ключ; остаётся последний из них.
+vector<string> table_keys(const vector<double>& axis) {
+    vector<string> keys(axis.size());
+    for (size_t i = 0; i < axis.size(); i++) append_fixed(keys[i], axis[i], 1);
+    return keys;
+}
+
+// Примерный размер full_data: ~24 символа на значение
+size_t full_data_size_hint(const CalcResult& r) {
+    return 24 * (r.table.size() + r.mu_T.size() + r.mu_gamma.size() + r.T_vals.size() + r.G_vals.size()) + 256;
+}
+
+void write_full_data(JsonWriter& w, const CalcResult& r) {
+    size_t nT = r.T_vals.size(), nG = r.G_vals.size();
+    w.begin_object();
+    w.key("T_range").numbers(r.T_vals);
+    w.key("gamma_range").numbers(r.G_vals);
+    w.key("T_points").numbers(r.T_points);
+    w.key("G_points").numbers(r.G_points);
+
+    w.key("mu_T").begin_array();
+    for (size_t i = 0; i < r.G_points.size(); i++) w.numbers(&r.mu_T[i * nT], nT);
+    w.end_array();
+
+    w.key("mu_gamma").begin_array();
+    for (size_t i = 0; i < r.T_points.size(); i++) w.numbers(&r.mu_gamma[i * nG], nG);
+    w.end_array();
+
+    vector<string> keys_T = table_keys(r.T_vals), keys_G = table_keys(r.G_vals);
+    w.key("mu_table").begin_object();
+    for (size_t i = 0; i < nT; i++) {
+        if (i + 1 < nT && keys_T[i] == keys_T[i + 1]) continue;
+        w.key(keys_T[i]).begin_object();
+        for (size_t k = 0; k < nG; k++) {
+            if (k + 1 < nG && keys_G[k] == keys_G[k + 1]) continue;
+            w.key(keys_G[k]).value(r.table[i * nG + k]);
+        }
+        w.end_object();
+    }
+    w.end_object();
+    w.end_object();
+}
+
+// CSV – полная таблица (как в интерфейсе): оси с одним знаком, вязкость с двумя.
+// Отчёт собирается фрагментами примерно по CSV_CHUNK_BYTES: их отдают клиенту и дописывают в файл.
+const size_t CSV_CHUNK_BYTES = 64 * 1024;
+
+// Заголовок: T \\ γ̇    |   γ̇1   γ̇2   ...   γ̇N
+void csv_header(const CalcResult& r, string& buf) {
+    buf += "T \\ γ̇";
+    for (double g : r.G_vals) {
+        buf += ',';
+        append_fixed(buf, g, 1);
+    }
+    buf += '\n';
+}
+
+// Строки: T1 → μ(T1,γ̇1), μ(T1,γ̇2), ... начиная с row, пока буфер меньше CSV_CHUNK_BYTES.
+// Возвращает номер следующей строки; T_vals.size() — строки закончились.
+size_t csv_rows(const CalcResult& r, size_t row, string& buf) {
+    for (; row < r.T_vals.size() && buf.size() < CSV_CHUNK_BYTES; row++) {
+        append_fixed(buf, r.T_vals[row], 1);  // Температура в первом столбце
+        for (size_t k = 0; k < r.G_vals.size(); k++) {
+            buf += ',';
+            append_fixed(buf, r.table[row * r.G_vals.size() + k], 2);
+        }
+        buf += '\n';
+    }
+    return row;
+}
+
+// === ВЫЧИСЛИТЕЛЬНЫЙ ПУЛ ===
+// Расчёт сетки, сборка JSON и запись отчёта выполняются здесь, а не в потоках HTTP:
+// потоки HTTP подбираются под число соединений, вычислительные — под число ядер.
+// Потоки закрепляются за ядрами; на Linux ядра берутся по очереди из разных узлов NUMA,
+// а данные расчёта создаются в самом потоке и по first-touch попадают в память его узла.
+// Настройка: EXTRUSION_COMPUTE_THREADS, EXTRUSION_COMPUTE_PIN (0 — не закреплять).
+vector<int> parse_cpulist(const string& list) {
+    vector<int> cpus;
+    std::stringstream ss(list);
+    string part;
+    while (getline(ss, part, ',')) {
+        try {
+            size_t dash = part.find('-');
+            int from = stoi(part.substr(0, dash));
+            int to = dash == string::npos ? from : stoi(part.substr(dash + 1));
+            for (int c = from; c <= to; c++) cpus.push_back(c);
+        }
+        catch (...) {}
+    }
+    return cpus;
+}
+
+// Порядок ядер для закрепления потоков: узлы NUMA чередуются
+vector<int> compute_cpu_order() {
+    vector<int> order;
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return order;
+
+    vector<vector<int>> nodes;
+    for (int node = 0; node < 256; node++) {
+        ifstream f("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+        if (!f) continue;
+        string list;
+        getline(f, list);
+        vector<int> cpus;
+        for (int c : parse_cpulist(list)) {
+            if (c < CPU_SETSIZE && CPU_ISSET(c, &allowed)) cpus.push_back(c);
+        }
+        if (!cpus.empty()) nodes.push_back(cpus);
+    }
+    if (nodes.empty()) {
+        nodes.emplace_back();
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &allowed)) nodes[0].push_back(c);
+        }
+    }
+    for (size_t k = 0;; k++) {
+        bool any = false;
+        for (const auto& cpus : nodes) {
+            if (k < cpus.size()) {
+                order.push_back(cpus[k]);
+                any = true;
+            }
+        }
+        if (!any) break;
+    }
+#elif defined(_WIN32)
+    // Без учёта групп процессоров: только первые 64 логических ядра
+    unsigned hw = std::min(64u, std::thread::hardware_concurrency());
+    for (unsigned c = 0; c < hw; c++) order.push_back(static_cast<int>(c));
+#endif
+    return order;
+}
+
+bool pin_current_thread(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+    return SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << cpu) != 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+class ComputeExecutor {
+private:
+    struct Task {
+        std::function<void()> work;
+        chrono::steady_clock::time_point enqueued;
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Task> queue;
+    vector<std::thread> workers;
+    vector<int> pinned;  // ядро каждого потока, -1 — без закрепления
+    bool stopping = false;
+
+    std::atomic<uint64_t> submitted{ 0 }, completed{ 0 }, wait_us{ 0 }, run_us{ 0 };
+
+    void run(size_t i) {
+        if (pinned[i] >= 0 && !pin_current_thread(pinned[i])) pinned[i] = -1;
+        for (;;) {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (stopping && queue.empty()) return;
+                task = std::move(queue.front());
+                queue.pop_front();
+            }
+            auto started = chrono::steady_clock::now();
+            wait_us += chrono::duration_cast<chrono::microseconds>(started - task.enqueued).count();
+            task.work();
+            run_us += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started).count();
+            completed++;
+        }
+    }
+
+public:
+    ComputeExecutor(size_t n, bool pin) {
+        n = std::max<size_t>(1, n);
+        vector<int> cpus = pin ? compute_cpu_order() : vector<int>();
+        for (size_t i = 0; i < n; i++) pinned.push_back(cpus.empty() ? -1 : cpus[i % cpus.size()]);
+        for (size_t i = 0; i < n; i++) workers.emplace_back([this, i] { run(i); });
+    }
+
+    ~ComputeExecutor() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    // Исключение из задачи передаётся в future
+    template <class F>
+    auto submit(F fn) -> std::future<decltype(fn())> {
+        using R = decltype(fn());
+        auto task = std::make_shared<std::packaged_task<R()>>(std::move(fn));
+        auto result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(Task{ [task] { (*task)(); }, chrono::steady_clock::now() });
+        }
+        submitted++;
+        cv.notify_one();
+        return result;
+    }
+
+    json metrics() {
+        size_t depth;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            depth = queue.size();
+        }
+        uint64_t done = completed.load();
+        return {
+            {"threads", workers.size()},
+            {"pinned_cpus", pinned},
+            {"queue_depth", depth},
+            {"submitted", submitted.load()},
+            {"completed", done},
+            {"avg_wait_ms", done ? wait_us.load() / 1000.0 / done : 0.0},
+            {"avg_run_ms", done ? run_us.load() / 1000.0 / done : 0.0}
+        };
+    }
+};
+
+std::unique_ptr<ComputeExecutor> compute_executor;
+
+// === ОБЪЕДИНЕНИЕ ОДИНАКОВЫХ РАСЧЁТОВ (single flight) ===
+// Когда смена одновременно открывает один и тот же материал с диапазонами по умолчанию,
+// сетка считается один раз: первый запрос с данным ключом запускает работу, остальные
+// ждут его результат и получают тот же сериализованный ответ. Ключ снимается сразу после
+// завершения — это не кэш, а только слияние запросов, пришедших во время расчёта.
+template <class V>
+class SingleFlight {
+    std::mutex mtx;
+    std::unordered_map<string, std::shared_future<V>> calls;
+    std::atomic<uint64_t> leaders{ 0 }, followers{ 0 };
+
+    void forget(const string& key) {
+        std::lock_guard<std::mutex> lock(mtx);
+        calls.erase(key);
+    }
+
+public:
+    // start() вызывается только для первого запроса с ключом и возвращает future результата.
+    // Исключение из расчёта получают все ожидающие.
+    template <class Start>
+    V run(const string& key, Start start) {
+        std::shared_future<V> call;
+        bool leader = false;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = calls.find(key);
+            if (it != calls.end()) {
+                call = it->second;
+                followers++;
+            }
+            else {
+                call = start().share();
+                calls.emplace(key, call);
+                leader = true;
+                leaders++;
+            }
+        }
+        if (!leader) return call.get();
+        try {
+            V v = call.get();
+            forget(key);
+            return v;
+        }
+        catch (...) {
+            forget(key);
+            throw;
+        }
+    }
+
+    json metrics() {
+        size_t inflight;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            inflight = calls.size();
+        }
+        uint64_t l = leaders.load(), f = followers.load();
+        return {
+            {"inflight", inflight},
+            {"computed", l},
+            {"coalesced", f},
+            {"coalesced_ratio", l + f ? static_cast<double>(f) / (l + f) : 0.0}
+        };
+    }
+};
+
+// Нормализованный ключ расчёта: параметры и коэффициенты материала в кратчайшей записи.
+// Коэффициенты входят в ключ, чтобы расчёт по изменённому материалу не слился со старым.
+string calc_key(const Material& m, const CalcRequest& p) {
+    string key = to_string(p.materialId);
+    for (double v : { m.mu0, m.b, m.T0, m.n, p.minT, p.maxT, p.deltaT, p.minG, p.maxG, p.deltaG }) {
+        key += ':';
+        append_shortest(key, v + 0.0);  // -0.0 и 0.0 — один ключ
+    }
+    return key;
+}
+
+SingleFlight<std::shared_ptr<const string>> calc_flights;
+SingleFlight<std::shared_ptr<const CalcResult>> grid_flights;
+
+// Сетка считается в вычислительном пуле. /api/calculate и построение отчёта с одинаковым ключом,
+// пришедшие во время расчёта, получают одну и ту же сетку. Не вызывается из задач пула:
+// задача, ждущая другую задачу того же пула, может его заблокировать.
+std::shared_ptr<const CalcResult> shared_grid(const Material& m, const CalcRequest& p) {
+    return grid_flights.run(calc_key(m, p), [&] {
+        return compute_executor->submit([m, p] { return std::make_shared<const CalcResult>(compute_grid(m, p)); });
+    });
+}
+
+// === ЗАПИСЬ ФАЙЛОВ ОТЧЁТОВ (io_uring) ===
+// Отчёт копируется в крупные выровненные буферы (REPORT_BUFFER_BYTES), заполненный буфер
+// отправляется в ядро операцией IORING_OP_WRITE, а запись продолжается в следующий —
+// поток не ждёт диск, пока есть свободный буфер. Кольцо создаётся прямыми системными вызовами
+// (без liburing). Если io_uring недоступен (старое ядро, seccomp в контейнере) или это не Linux,
+// используется ofstream с буфером того же размера; после первой неудачи кольцо больше не пробуется.
+// IORING_OP_WRITE есть только с ядра 5.6 (на 5.1–5.5 кольцо создаётся, но запись отклоняется
+// с EINVAL), поэтому при создании кольца операция проверяется через IORING_REGISTER_PROBE.
+const size_t REPORT_BUFFER_BYTES = 1024 * 1024;
+const unsigned REPORT_BUFFERS = 4;
+
+struct ReportWriterStats {
+    std::atomic<uint64_t> uring_files{ 0 }, stdio_files{ 0 }, bytes{ 0 }, submissions{ 0 }, waits{ 0 };
+#ifdef EXTRUSION_URING
+    std::atomic<bool> uring_disabled{ false };
+#else
+    std::atomic<bool> uring_disabled{ true };
+#endif
+
+    json metrics() const {
+        return {
+            {"backend", uring_disabled.load() ? "stdio" : "io_uring"},
+            {"uring_files", uring_files.load()},
+            {"stdio_files", stdio_files.load()},
+            {"bytes", bytes.load()},
+            {"submissions", submissions.load()},
+            {"buffer_waits", waits.load()}
+        };
+    }
+};
+
+ReportWriterStats report_writer_stats;
+
+#ifdef EXTRUSION_URING
+class UringFile {
+private:
+    struct Buffer {
+        char* data = nullptr;
+        size_t used = 0;
+        uint64_t offset = 0;
+        bool in_flight = false;
+    };
+
+    int ring = -1, fd = -1;
+    void* sq_ptr = MAP_FAILED;
+    void* cq_ptr = MAP_FAILED;
+    size_t sq_size = 0, cq_size = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqes_size = 0;
+    unsigned *sq_tail = nullptr, *sq_mask = nullptr, *sq_array = nullptr;
+    unsigned *cq_head = nullptr, *cq_tail = nullptr, *cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    std::array<Buffer, REPORT_BUFFERS> buffers;
+    unsigned current = 0;
+    uint64_t offset = 0;
+    unsigned in_flight = 0;
+    bool failed = false;
+    bool sync = false;  // ядро отклонило IORING_OP_WRITE — остаток файла пишется pwrite
+
+    // Поддерживает ли ядро IORING_OP_WRITE; ядра без IORING_REGISTER_PROBE старше 5.6 и его не знают
+    bool write_supported() {
+        const unsigned ops = 256;
+        vector<char> raw(sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op));
+        auto* probe = reinterpret_cast<io_uring_probe*>(raw.data());
+        if (syscall(__NR_io_uring_register, ring, IORING_REGISTER_PROBE, probe, ops) < 0) return false;
+        return probe->last_op >= IORING_OP_WRITE && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    bool setup() {
+        io_uring_params params{};
+        ring = static_cast<int>(syscall(__NR_io_uring_setup, REPORT_BUFFERS, &params));
+        if (ring < 0) return false;
+        if (!write_supported()) {
+            errno = EOPNOTSUPP;
+            return false;
+        }
+
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) sq_size = cq_size = std::max(sq_size, cq_size);
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) return false;
+        cq_ptr = single ? sq_ptr
+            : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) return false;
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED) return false;
+
+        char* sq = static_cast<char*>(sq_ptr);
+        char* cq = static_cast<char*>(cq_ptr);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    void submit(unsigned index) {
+        Buffer& b = buffers[index];
+        if (sync) {
+            b.in_flight = true;
+            in_flight++;
+            complete(index, pwrite(fd, b.data, b.used, static_cast<off_t>(b.offset)));
+            return;
+        }
+        unsigned tail = *sq_tail;
+        unsigned slot = tail & *sq_mask;
+        io_uring_sqe& sqe = sqes[slot];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_WRITE;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(b.data);
+        sqe.len = static_cast<uint32_t>(b.used);
+        sqe.off = b.offset;
+        sqe.user_data = index;
+        sq_array[slot] = slot;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        b.in_flight = true;
+        in_flight++;
+        report_writer_stats.submissions++;
+        if (syscall(__NR_io_uring_enter, ring, 1, 0, 0, nullptr, 0) < 0) {
+            // Не принято ядром — пишем тем же буфером синхронно
+            __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+            complete(index, pwrite(fd, b.data, b.used, static_cast<off_t>(b.offset)));
+        }
+    }
+
+    void complete(unsigned index, long long res) {
+        Buffer& b = buffers[index];
+        if (res == -EINVAL || res == -EOPNOTSUPP) {
+            // Операция не поддерживается, хотя проба её показала: буфер пишется заново синхронно,
+            // остаток файла — pwrite, следующие отчёты — ofstream
+            sync = true;
+            report_writer_stats.uring_disabled = true;
+            res = 0;
+        }
+        // Короткая запись в обычный файл редка — дописываем остаток синхронно
+        size_t done = res > 0 ? static_cast<size_t>(res) : 0;
+        while (res >= 0 && done < b.used) {
+            res = pwrite(fd, b.data + done, b.used - done, static_cast<off_t>(b.offset + done));
+            if (res > 0) done += static_cast<size_t>(res);
+            else if (res == 0) res = -1;
+        }
+        if (res < 0) failed = true;
+        b.in_flight = false;
+        b.used = 0;
+        in_flight--;
+    }
+
+    // Ждёт хотя бы одно завершение и разбирает очередь завершений
+    void reap() {
+        unsigned head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            report_writer_stats.waits++;
+            if (syscall(__NR_io_uring_enter, ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+                failed = true;
+                return;
+            }
+        }
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            const io_uring_cqe& cqe = cqes[head & *cq_mask];
+            complete(static_cast<unsigned>(cqe.user_data), cqe.res);
+            head++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+
+public:
+    ~UringFile() {
+        while (in_flight && !failed) reap();
+        for (auto& b : buffers) std::free(b.data);
+        if (fd >= 0) ::close(fd);
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+        if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+        if (ring >= 0) ::close(ring);
+    }
+
+    // false — io_uring недоступен; файл не создан
+    bool open(const fs::path& path) {
+        if (!setup()) return false;
+        for (auto& b : buffers) {
+            b.data = static_cast<char*>(std::aligned_alloc(4096, REPORT_BUFFER_BYTES));
+            if (!b.data) return false;
+        }
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        return fd >= 0;
+    }
+
+    bool write(const char* data, size_t len) {
+        while (len && !failed) {
+            Buffer& b = buffers[current];
+            if (b.in_flight) {
+                reap();
+                continue;
+            }
+            if (b.used == 0) b.offset = offset;
+            size_t n = std::min(len, REPORT_BUFFER_BYTES - b.used);
+            memcpy(b.data + b.used, data, n);
+            b.used += n;
+            offset += n;
+            data += n;
+            len -= n;
+            if (b.used == REPORT_BUFFER_BYTES) {
+                submit(current);
+                current = (current + 1) % REPORT_BUFFERS;
+            }
+        }
+        return !failed;
+    }
+
+    bool close() {
+        if (buffers[current].used && !buffers[current].in_flight) submit(current);
+        while (in_flight && !failed) reap();
+        bool ok = !failed && ::close(fd) == 0;
+        fd = -1;
+        return ok;
+    }
+};
+#endif
+
+// Файл отчёта: io_uring, если доступен, иначе ofstream
+class ReportFile {
+private:
+#ifdef EXTRUSION_URING
+    std::unique_ptr<UringFile> uring;
+#endif
+    std::unique_ptr<char[]> stdio_buffer;
+    ofstream stdio;
+    bool failed = false;
+
+public:
+    bool open(const fs::path& path) {
+#ifdef EXTRUSION_URING
+        if (!report_writer_stats.uring_disabled) {
+            uring = std::make_unique<UringFile>();
+            if (uring->open(path)) {
+                report_writer_stats.uring_files++;
+                return true;
+            }
+            int err = errno;
+            uring.reset();
+            if (err == ENOSYS || err == EPERM || err == EOPNOTSUPP) report_writer_stats.uring_disabled = true;
+        }
+#endif
+        stdio_buffer.reset(new char[REPORT_BUFFER_BYTES]);
+        stdio.rdbuf()->pubsetbuf(stdio_buffer.get(), REPORT_BUFFER_BYTES);
+        stdio.open(path, ios::binary);
+        report_writer_stats.stdio_files++;
+        return static_cast<bool>(stdio);
+    }
+
+    bool write(const char* data, size_t len) {
+        if (failed) return false;
+#ifdef EXTRUSION_URING
+        if (uring) failed = !uring->write(data, len);
+        else
+#endif
+            failed = !stdio.write(data, len);
+        if (!failed) report_writer_stats.bytes += len;
+        return !failed;
+    }
+
+    // true — файл записан целиком
+    bool close() {
+#ifdef EXTRUSION_URING
+        if (uring) return uring->close() && !failed;
+#endif
+        stdio.close();
+        return !stdio.fail() && !failed;
+    }
+};
+
+// === ХРАНИЛИЩЕ ОТЧЁТОВ (по содержимому) ===
+// CSV-отчёты лежат в ./reports под именем <ключ>.csv, ключ — хэш нормализованных параметров
+// расчёта (calc_key). Одинаковые расчёты дают один файл. Файл появляется при первом скачивании
+// (см. ReportRegistry): пишется во временный и переименовывается, поэтому читатель видит либо
+// старую версию, либо целиком новую. Индекс (размер, последнее обращение) хранится в памяти;
+// фоновый поток удаляет отчёты старше TTL и самые давние при превышении квоты.
+// Настройка: EXTRUSION_REPORT_TTL_S (86400), EXTRUSION_REPORT_QUOTA_MB (1024).
+class ReportStore {
+private:
+    struct Entry {
+        uintmax_t size = 0;
+        fs::file_time_type used;
+    };
+
+    const fs::path dir;
+    const chrono::seconds ttl;
+    const uintmax_t quota;
+
+    std::mutex mtx;
+    std::unordered_map<string, Entry> index;
+    uintmax_t total = 0;
+    std::atomic<uint64_t> served{ 0 }, writes{ 0 }, write_errors{ 0 }, evicted_ttl{ 0 }, evicted_quota{ 0 };
+
+    std::thread sweeper;
+    std::mutex stop_mutex;
+    std::condition_variable stop_cv;
+    bool stopping = false;
+
+    static bool valid_key(const string& key) {
+        return key.size() == 32 && key.find_first_not_of("0123456789abcdef") == string::npos;
+    }
+
+    // Индекс по файлам каталога; недописанные временные файлы прошлого запуска удаляются
+    void scan() {
+        std::error_code ec;
+        fs::create_directories(dir, ec);
+        for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+            const fs::path& p = it->path();
+            std::error_code fe;
+            if (p.filename().string().find(".tmp-") != string::npos) {
+                fs::remove(p, fe);
+                continue;
+            }
+            string key = p.stem().string();
+            if (p.extension() != ".csv" || !valid_key(key) || !it->is_regular_file(fe)) continue;
+            Entry e{ it->file_size(fe), it->last_write_time(fe) };
+            if (fe) continue;
+            index[key] = e;
+            total += e.size;
+        }
+    }
+
+    // Под mtx
+    void erase(std::unordered_map<string, Entry>::iterator it) {
+        std::error_code ec;
+        fs::remove(path(it->first), ec);
+        total -= it->second.size;
+        index.erase(it);
+    }
+
+public:
+    ReportStore(const string& directory)
+        : dir(directory),
+        ttl(std::max(60L, env_long("EXTRUSION_REPORT_TTL_S", 86400))),
+        quota(static_cast<uintmax_t>(std::max(1L, env_long("EXTRUSION_REPORT_QUOTA_MB", 1024))) * 1024 * 1024) {
+        scan();
+        sweeper = std::thread([this] {
+            std::unique_lock<std::mutex> lock(stop_mutex);
+            while (!stop_cv.wait_for(lock, chrono::seconds(60), [&] { return stopping; })) {
+                lock.unlock();
+                sweep();
+                lock.lock();
+            }
+        });
+    }
+
+    ~ReportStore() {
+        {
+            std::lock_guard<std::mutex> lock(stop_mutex);
+            stopping = true;
+        }
+        stop_cv.notify_all();
+        sweeper.join();
+    }
+
+    static string key_for(const string& normalized) { return sha256_hex(normalized, 16); }
+    static string url(const string& key) { return "/api/reports/" + key + ".csv"; }
+    fs::path path(const string& key) const { return dir / (key + ".csv"); }
+
+    // Путь к готовому отчёту (с отметкой обращения) или пусто
+    std::optional<fs::path> locate(const string& key) {
+        if (!valid_key(key)) return std::nullopt;
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = index.find(key);
+        if (it == index.end()) return std::nullopt;
+        it->second.used = fs::file_time_type::clock::now();
+        served++;
+        return path(key);
+    }
+
+    // Уникальный временный файл для записи отчёта key
+    fs::path temp_path(const string& key) const { return dir / (key + ".csv.tmp-" + random_hex(4)); }
+
+    // Дописанный временный файл становится отчётом key (атомарная замена, в т.ч. параллельной записи)
+    bool commit(const string& key, const fs::path& tmp) {
+        std::error_code ec;
+        uintmax_t size = fs::file_size(tmp, ec);
+        if (!ec) fs::rename(tmp, path(key), ec);
+        if (ec) {
+            discard(tmp);
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mtx);
+        auto [it, inserted] = index.try_emplace(key);
+        if (!inserted) total -= it->second.size;
+        it->second = Entry{ size, fs::file_time_type::clock::now() };
+        total += size;
+        writes++;
+        return true;
+    }
+
+    // Недописанный отчёт: failed — ошибка записи, иначе отмена или отключение клиента
+    void discard(const fs::path& tmp, bool failed = true) {
+        std::error_code ec;
+        fs::remove(tmp, ec);
+        if (failed) write_errors++;
+    }
+
+    void sweep() {
+        auto now = fs::file_time_type::clock::now();
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto it = index.begin(); it != index.end();) {
+            auto next = std::next(it);
+            if (now - it->second.used > ttl) {
+                erase(it);
+                evicted_ttl++;
+            }
+            it = next;
+        }
+        if (total <= quota) return;
+
+        vector<std::pair<fs::file_time_type, string>> order;
+        order.reserve(index.size());
+        for (const auto& [key, e] : index) order.emplace_back(e.used, key);
+        std::sort(order.begin(), order.end());
+        for (const auto& [used, key] : order) {
+            if (total <= quota) break;
+            erase(index.find(key));
+            evicted_quota++;
+        }
+    }
+
+    json metrics() {
+        size_t files;
+        uintmax_t bytes;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            files = index.size();
+            bytes = total;
+        }
+        return {
+            {"files", files},
+            {"bytes", bytes},
+            {"quota_bytes", quota},
+            {"ttl_s", ttl.count()},
+            {"served", served.load()},
+            {"writes", writes.load()},
+            {"write_errors", write_errors.load()},
+            {"evicted_ttl", evicted_ttl.load()},
+            {"evicted_quota", evicted_quota.load()}
+        };
+    }
+};
+
+std::unique_ptr<ReportStore> report_store;
+
+// === ОТЧЁТЫ ПО ЗАПРОСУ ===
+// Расчёт не пишет CSV: он только регистрирует параметры под ключом отчёта и кладёт готовую
+// сетку в LRU-кэш. report_url ведёт на /api/reports/<ключ>.csv; при первом скачивании CSV
+// строится из сетки (или сетка пересчитывается, если её уже вытеснили) и отдаётся потоком,
+// параллельно дописываясь в хранилище — следующие скачивания идут из файла.
+// Настройка: EXTRUSION_GRID_CACHE_MB (256).
+const size_t REPORT_SPECS_MAX = 65536;
+
+class ReportRegistry {
+public:
+    struct Spec {
+        Material material;
+        CalcRequest params;
+    };
+
+private:
+    using Grid = std::shared_ptr<const CalcResult>;
+
+    std::mutex mtx;
+    // LRU: в начале списка — последние обращения
+    std::list<string> spec_order, grid_order;
+    std::unordered_map<string, std::pair<Spec, std::list<string>::iterator>> specs;
+    std::unordered_map<string, std::pair<Grid, std::list<string>::iterator>> grids;
+    size_t grid_bytes = 0;
+    size_t grid_budget = 0;
+    std::atomic<uint64_t> registered{ 0 }, grid_hits{ 0 }, recomputed{ 0 };
+
+    static size_t bytes_of(const CalcResult& r) {
+        return sizeof(double) * (r.table.size() + r.mu_T.size() + r.mu_gamma.size() + r.T_vals.size() + r.G_vals.size());
+    }
+
+    // Под mtx
+    void keep_grid(const string& key, Grid grid) {
+        if (auto it = grids.find(key); it != grids.end()) {
+            grid_order.splice(grid_order.begin(), grid_order, it->second.second);
+            return;
+        }
+        size_t bytes = bytes_of(*grid);
+        if (bytes > grid_budget) return;
+        grid_order.push_front(key);
+        grids.emplace(key, std::make_pair(std::move(grid), grid_order.begin()));
+        grid_bytes += bytes;
+        while (grid_bytes > grid_budget) {
+            auto last = grids.find(grid_order.back());
+            grid_bytes -= bytes_of(*last->second.first);
+            grids.erase(last);
+            grid_order.pop_back();
+        }
+    }
+
+public:
+    void configure() {
+        grid_budget = static_cast<size_t>(std::max(0L, env_long("EXTRUSION_GRID_CACHE_MB", 256))) * 1024 * 1024;
+    }
+
+    // Регистрирует расчёт и возвращает report_url
+    string add(const Material& m, const CalcRequest& p, Grid grid) {
+        string key = ReportStore::key_for(calc_key(m, p));
+        std::lock_guard<std::mutex> lock(mtx);
+        if (auto it = specs.find(key); it != specs.end()) {
+            spec_order.splice(spec_order.begin(), spec_order, it->second.second);
+        }
+        else {
+            spec_order.push_front(key);
+            specs.emplace(key, std::make_pair(Spec{ m, p }, spec_order.begin()));
+            if (specs.size() > REPORT_SPECS_MAX) {
+                specs.erase(spec_order.back());
+                spec_order.pop_back();
+            }
+        }
+        if (grid) keep_grid(key, std::move(grid));
+        registered++;
+        return ReportStore::url(key);
+    }
+
+    std::optional<Spec> spec(const string& key) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = specs.find(key);
+        if (it == specs.end()) return std::nullopt;
+        return it->second.first;
+    }
+
+    // Сетка из кэша или пересчёт в вычислительном пуле
+    Grid grid(const string& key, const Spec& spec) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (auto it = grids.find(key); it != grids.end()) {
+                grid_order.splice(grid_order.begin(), grid_order, it->second.second);
+                grid_hits++;
+                return it->second.first;
+            }
+        }
+        Grid g = shared_grid(spec.material, spec.params);
+        recomputed++;
+        std::lock_guard<std::mutex> lock(mtx);
+        keep_grid(key, g);
+        return g;
+    }
+
+    json metrics() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return {
+            {"specs", specs.size()},
+            {"grids", grids.size()},
+            {"grid_bytes", grid_bytes},
+            {"grid_budget_bytes", grid_budget},
+            {"registered", registered.load()},
+            {"grid_hits", grid_hits.load()},
+            {"recomputed", recomputed.load()}
+        };
+    }
+};
+
+ReportRegistry report_registry;
+
+// Потоковая отдача CSV с одновременной записью в хранилище.
+// Файл фиксируется, только если клиент получил отчёт целиком.
+class CsvReportStream {
+    std::shared_ptr<const CalcResult> grid;
+    string key;
+    fs::path tmp;
+    ReportFile file;
+    size_t next_row = 0;
+    bool header_sent = false, complete = false, file_ok = false;
+
+public:
+    CsvReportStream(std::shared_ptr<const CalcResult> g, string k) : grid(std::move(g)), key(std::move(k)) {}
+
+    bool step(httplib::DataSink& sink) {
+        string buf;
+        buf.reserve(CSV_CHUNK_BYTES + 4096);
+        if (!header_sent) {
+            tmp = report_store->temp_path(key);
+            file_ok = file.open(tmp);
+            csv_header(*grid, buf);
+            header_sent = true;
+        }
+        next_row = csv_rows(*grid, next_row, buf);
+        if (file_ok) file_ok = file.write(buf.data(), buf.size());
+        if (!sink.write(buf.data(), buf.size())) return false;
+        if (next_row == grid->T_vals.size()) {
+            complete = true;
+            sink.done();
+        }
+        return true;
+    }
+
+    // releaser httplib: success — ответ отправлен полностью
+    void finish(bool success) {
+        if (!header_sent) return;  // HEAD или отказ до начала отдачи
+        file_ok = file.close() && file_ok;
+        if (success && complete && file_ok) report_store->commit(key, tmp);
+        else report_store->discard(tmp, !file_ok);
+    }
+};
+
+// Пишет отчёт key в хранилище из готовой сетки. progress получает число записанных строк;
+// false из него отменяет запись (временный файл удаляется).
+bool write_report_file(const CalcResult& grid, const string& key, const std::function<bool(size_t)>& progress) {
+    fs::path tmp = report_store->temp_path(key);
+    ReportFile file;
+    bool ok = file.open(tmp);
+    string buf;
+    buf.reserve(CSV_CHUNK_BYTES + 4096);
+    csv_header(grid, buf);
+    size_t row = 0;
+    bool cancelled = false;
+    while (ok && !cancelled && row < grid.T_vals.size()) {
+        row = csv_rows(grid, row, buf);
+        ok = file.write(buf.data(), buf.size());
+        buf.clear();
+        cancelled = !progress(row);
+    }
+    if (ok && !buf.empty()) ok = file.write(buf.data(), buf.size());  // только заголовок
+    ok = file.close() && ok;
+    if (cancelled || !ok) {
+        report_store->discard(tmp, !cancelled);
+        return false;
+    }
+    return report_store->commit(key, tmp);
+}
+
+// === ФОНОВЫЕ ЗАДАНИЯ ОТЧЁТОВ ===
+// POST /api/reports/jobs ставит построение отчёта в очередь и сразу возвращает id задания;
+// ограниченный пул потоков считает сетку (через вычислительный пул) и пишет файл в хранилище.
+// Состояние и прогресс — GET /api/reports/jobs/<id>, отмена — DELETE; готовый файл скачивается
+// по report_url. Задание с тем же ключом, ещё не завершённое, переиспользуется. Завершённые
+// задания хранятся JOB_RETENTION и видны только автору (и администратору).
+// Настройка: EXTRUSION_REPORT_WORKERS (2), EXTRUSION_REPORT_QUEUE (32).
+const chrono::minutes JOB_RETENTION(60);
+
+enum class JobState { Queued, Running, Done, Failed, Cancelled };
+
+const char* job_state_name(JobState s) {
+    switch (s) {
+    case JobState::Queued: return "queued";
+    case JobState::Running: return "running";
+    case JobState::Done: return "done";
+    case JobState::Failed: return "failed";
+    default: return "cancelled";
+    }
+}
+
+struct ReportJob {
+    string id, key, owner;
+    ReportRegistry::Spec spec;
+    std::atomic<JobState> state{ JobState::Queued };
+    std::atomic<bool> cancel{ false };
+    std::atomic<size_t> rows_done{ 0 }, rows_total{ 0 };
+    chrono::steady_clock::time_point finished;  // под mutex ReportJobs
+
+    bool terminal() const {
+        JobState s = state.load();
+        return s == JobState::Done || s == JobState::Failed || s == JobState::Cancelled;
+    }
+};
+
+class ReportJobs {
+private:
+    const size_t max_queue;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<ReportJob>> queue;
+    std::unordered_map<string, std::shared_ptr<ReportJob>> jobs;
+    vector<std::thread> workers;
+    bool stopping = false;
+    std::atomic<uint64_t> submitted{ 0 }, reused{ 0 }, completed{ 0 }, failed{ 0 }, cancelled{ 0 }, rejected{ 0 };
+
+    // Под mtx: завершённые задания старше JOB_RETENTION
+    void purge() {
+        auto now = chrono::steady_clock::now();
+        for (auto it = jobs.begin(); it != jobs.end();) {
+            if (it->second->terminal() && now - it->second->finished > JOB_RETENTION) it = jobs.erase(it);
+            else ++it;
+        }
+    }
+
+    void finish(ReportJob& job, JobState state) {
+        std::lock_guard<std::mutex> lock(mtx);
+        job.finished = chrono::steady_clock::now();
+        job.state = state;
+        (state == JobState::Done ? completed : state == JobState::Cancelled ? cancelled : failed)++;
+    }
+
+    void run(ReportJob& job) {
+        try {
+            if (report_store->locate(job.key)) {
+                job.rows_done = job.rows_total.load();
+                finish(job, JobState::Done);
+                return;
+            }
+            auto grid = report_registry.grid(job.key, job.spec);
+            job.rows_total = grid->T_vals.size();
+            if (job.cancel) {
+                finish(job, JobState::Cancelled);
+                return;
+            }
+            bool ok = write_report_file(*grid, job.key, [&job](size_t rows) {
+                job.rows_done = rows;
+                return !job.cancel.load();
+            });
+            finish(job, ok ? JobState::Done : job.cancel ? JobState::Cancelled : JobState::Failed);
+        }
+        catch (const std::exception& e) {
+            std::cerr << "REPORT JOB ERROR: " << e.what() << std::endl;
+            finish(job, JobState::Failed);
+        }
+    }
+
+    void worker_loop() {
+        while (true) {
+            std::shared_ptr<ReportJob> job;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (stopping) return;
+                job = std::move(queue.front());
+                queue.pop_front();
+            }
+            if (job->cancel) {
+                finish(*job, JobState::Cancelled);
+                continue;
+            }
+            job->state = JobState::Running;
+            run(*job);
+        }
+    }
+
+public:
+    ReportJobs()
+        : max_queue(static_cast<size_t>(std::max(1L, env_long("EXTRUSION_REPORT_QUEUE", 32)))) {
+        long n = std::max(1L, env_long("EXTRUSION_REPORT_WORKERS", 2));
+        for (long i = 0; i < n; i++) workers.emplace_back([this] { worker_loop(); });
+    }
+
+    ~ReportJobs() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& w : workers) w.join();
+    }
+
+    // nullptr — очередь заполнена
+    std::shared_ptr<ReportJob> submit(const string& owner, const Material& m, const CalcRequest& p) {
+        report_registry.add(m, p, nullptr);  // report_url работает и без задания — построит отчёт при скачивании
+        string key = ReportStore::key_for(calc_key(m, p));
+        std::lock_guard<std::mutex> lock(mtx);
+        purge();
+        for (const auto& [id, job] : jobs) {
+            if (job->key == key && job->owner == owner && !job->terminal()) {
+                reused++;
+                return job;
+            }
+        }
+        if (queue.size() >= max_queue) {
+            rejected++;
+            return nullptr;
+        }
+        auto job = std::make_shared<ReportJob>();
+        job->id = random_hex(8);
+        job->key = key;
+        job->owner = owner;
+        job->spec = ReportRegistry::Spec{ m, p };
+        jobs[job->id] = job;
+        queue.push_back(job);
+        submitted++;
+        cv.notify_one();
+        return job;
+    }
+
+    std::shared_ptr<ReportJob> find(const string& id) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = jobs.find(id);
+        return it == jobs.end() ? nullptr : it->second;
+    }
+
+    // Задание в очереди снимается воркером, выполняющееся — на ближайшем блоке записи
+    void cancel(ReportJob& job) { job.cancel = true; }
+
+    static json status(const ReportJob& job) {
+        JobState s = job.state.load();
+        size_t total = job.rows_total.load(), done = job.rows_done.load();
+        json j = {
+            {"id", job.id},
+            {"status", job_state_name(s)},
+            {"rows_done", done},
+            {"rows_total", total},
+            {"progress", s == JobState::Done ? 1.0 : total ? static_cast<double>(done) / total : 0.0}
+        };
+        if (s == JobState::Done) j["report_url"] = ReportStore::url(job.key);
+        return j;
+    }
+
+    json metrics() {
+        size_t depth, active = 0;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            depth = queue.size();
+            for (const auto& [id, job] : jobs) active += job->state.load() == JobState::Running;
+        }
+        return {
+            {"workers", workers.size()},
+            {"queue_depth", depth},
+            {"running", active},
+            {"submitted", submitted.load()},
+            {"reused", reused.load()},
+            {"completed", completed.load()},
+            {"failed", failed.load()},
+            {"cancelled", cancelled.load()},
+            {"rejected", rejected.load()}
+        };
+    }
+};
+
+std::unique_ptr<ReportJobs> report_jobs;
+
+// === ПАКЕТНЫЙ РАСЧЁТ ===
+// Ответ /api/calculate: сетка регистрируется как отчёт, тело собирается JsonWriter
+std::shared_ptr<const string> calc_response(const Material& m, const CalcRequest& p, std::shared_ptr<const CalcResult> grid) {
+    const CalcResult& r = *grid;
+    string report_url = report_registry.add(m, p, grid);
+
+    JsonWriter w(full_data_size_hint(r));
+    w.begin_object();
+    w.key("full_data");
+    write_full_data(w, r);
+    w.key("report_url").value(report_url);
+    w.key("performance").begin_object()
+        .key("time_ms").value(r.time_ms)
+        .key("memory_kb").value(uint64_t{ 1024 })
+        .key("operations").value(uint64_t{ 50 * r.T_vals.size() * r.G_vals.size() })
+        .end_object();
+    w.end_object();
+    return std::make_shared<const string>(w.take());
+}
+
+// Несколько расчётов одним запросом (экран сравнения материалов). Одинаковые задания
+// считаются один раз, оси строятся один раз на набор диапазонов, уникальные расчёты
+// выполняются в вычислительном пуле параллельно. results[i] совпадает с ответом
+// /api/calculate для i-го задания.
+const size_t BATCH_JOBS_MAX = 16;
+
+struct BatchJob {
+    Material material;
+    CalcRequest params;
+};
+
+class BatchCalculator {
+    std::atomic<uint64_t> batches{ 0 }, jobs{ 0 }, computed{ 0 }, axes_built{ 0 };
+
+    static string axes_key(const CalcRequest& p) {
+        string key;
+        for (double v : { p.minT, p.maxT, p.deltaT, p.minG, p.maxG, p.deltaG }) {
+            append_shortest(key, v + 0.0);
+            key += ':';
+        }
+        return key;
+    }
+
+public:
+    string run(const vector<BatchJob>& list) {
+        auto start = chrono::high_resolution_clock::now();
+
+        // slot[i] — номер уникального расчёта для задания i
+        vector<size_t> slot(list.size());
+        vector<string> keys;
+        vector<std::future<std::shared_ptr<const string>>> pending;
+        std::unordered_map<string, std::shared_ptr<const GridAxes>> axes;
+        for (size_t i = 0; i < list.size(); i++) {
+            const BatchJob& job = list[i];
+            string key = calc_key(job.material, job.params);
+            auto found = std::find(keys.begin(), keys.end(), key);
+            slot[i] = static_cast<size_t>(found - keys.begin());
+            if (found != keys.end()) continue;
+            keys.push_back(std::move(key));
+
+            auto& shared = axes[axes_key(job.params)];
+            if (!shared) shared = std::make_shared<const GridAxes>(make_axes(job.params));
+            pending.push_back(compute_executor->submit([job, ax = shared] {
+                return calc_response(job.material, job.params,
+                    std::make_shared<const CalcResult>(compute_grid(job.material, job.params, *ax)));
+            }));
+        }
+
+        // Ждём все задания, даже если одно из них упало: их лямбды держат только свои копии
+        vector<std::shared_ptr<const string>> bodies(pending.size());
+        std::exception_ptr error;
+        for (size_t u = 0; u < pending.size(); u++) {
+            try {
+                bodies[u] = pending[u].get();
+            }
+            catch (...) {
+                if (!error) error = std::current_exception();
+            }
+        }
+        if (error) std::rethrow_exception(error);
+
+        size_t total = 0;
+        for (size_t i = 0; i < list.size(); i++) total += bodies[slot[i]]->size() + 1;
+        JsonWriter w(total + 256);
+        w.begin_object();
+        w.key("results").begin_array();
+        for (size_t i = 0; i < list.size(); i++) w.raw(*bodies[slot[i]]);
+        w.end_array();
+        w.key("performance").begin_object()
+            .key("time_ms").value(chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count())
+            .key("jobs").value(uint64_t{ list.size() })
+            .key("computed").value(uint64_t{ bodies.size() })
+            .key("axes").value(uint64_t{ axes.size() })
+            .end_object();
+        w.end_object();
+
+        batches++;
+        jobs += list.size();
+        computed += bodies.size();
+        axes_built += axes.size();
+        return w.take();
+    }
+
+    json metrics() const {
+        return {
+            {"batches", batches.load()},
+            {"jobs", jobs.load()},
+            {"computed", computed.load()},
+            {"axes_built", axes_built.load()}
+        };
+    }
+};
+
+BatchCalculator batch_calculator;
+
+// === СРАВНЕНИЕ МАТЕРИАЛОВ (SoA) ===
+// Сравнение марок на одной сетке T × γ̇: структура расчёта та же, меняются только коэффициенты
+// (mu0, b, T0, n). Они хранятся массивами по материалам (structure of arrays), множители узлов —
+// таблицами [материал][узел]: аргументы exp для всех марок и узлов T собираются в одну таблицу
+// и считаются одним векторным exp_block, степенные множители — pow_block по оси γ̇ для каждой
+// марки. Таблицы вязкости заполняются построчно [материал][T][γ̇] умножением строки степенных
+// множителей на скаляр, множители читаются подряд. Ядра exp/pow и порядок умножений те же,
+// что в compute_grid, так что значения для каждой марки совпадают с /api/calculate.
+const size_t COMPARE_MATERIALS_MAX = 16;
+
+struct MaterialSoA {
+    vector<double> mu0, b, T0, n1;  // n1 = n - 1
+
+    explicit MaterialSoA(const vector<Material>& list) {
+        for (const Material& m : list) {
+            mu0.push_back(m.mu0);
+            b.push_back(m.b);
+            T0.push_back(m.T0);
+            n1.push_back(m.n - 1.0);
+        }
+    }
+    size_t size() const { return mu0.size(); }
+};
+
+struct CompareResult {
+    GridAxes axes;
+    vector<double> T_points, G_points;
+    size_t count = 0;
+    vector<double> table;     // материал × T × γ̇
+    vector<double> mu_T;      // материал × G_points × T
+    vector<double> mu_gamma;  // материал × T_points × γ̇
+    double time_ms = 0;
+
+    const double* row(size_t m, size_t i) const {
+        return &table[(m * axes.T_vals.size() + i) * axes.G_vals.size()];
+    }
+};
+
+// out[m * nT + j] = exp(b·(T0 − Tк)/Tк) для материала m и узла T[j]
+void temp_factors(const MaterialSoA& s, const vector<double>& T, vector<double>& out) {
+    size_t M = s.size(), nT = T.size();
+    vector<double> args(M * nT);
+    for (size_t m = 0; m < M; m++) {
+        double b = s.b[m], T0 = s.T0[m];
+        double* a = &args[m * nT];
+        for (size_t j = 0; j < nT; j++) {
+            double temp_k = T[j] + 273.15;
+            a[j] = b * (T0 - temp_k) / temp_k;
+        }
+    }
+    out.resize(args.size());
+    exp_block(args.data(), out.data(), args.size());
+}
+
+// out[m * nG + j] = G[j]^(n − 1)
+void shear_factors(const MaterialSoA& s, const vector<double>& G, vector<double>& out) {
+    size_t M = s.size(), nG = G.size();
+    out.resize(M * nG);
+    for (size_t m = 0; m < M; m++) pow_block(G.data(), s.n1[m], &out[m * nG], nG);
+}
+
+CompareResult compare_grid(const vector<Material>& materials, const CalcRequest& p) {
+    auto start = chrono::high_resolution_clock::now();
+
+    CompareResult r;
+    r.axes = make_axes(p);
+    r.T_points = { p.minT, (p.minT + p.maxT) / 2.0, p.maxT };
+    r.G_points = { p.minG, (p.minG + p.maxG) / 2.0, p.maxG };
+    MaterialSoA s(materials);
+    size_t M = s.size(), nT = r.axes.T_vals.size(), nG = r.axes.G_vals.size();
+    r.count = M;
+
+    vector<double> exp_T, pow_G, exp_Tp, pow_Gp;
+    temp_factors(s, r.axes.T_vals, exp_T);
+    shear_factors(s, r.axes.G_vals, pow_G);
+    temp_factors(s, r.T_points, exp_Tp);
+    shear_factors(s, r.G_points, pow_Gp);
+
+    r.table.resize(M * nT * nG);
+    r.mu_T.resize(M * r.G_points.size() * nT);
+    r.mu_gamma.resize(M * r.T_points.size() * nG);
+    for (size_t m = 0; m < M; m++) {
+        double mu0 = s.mu0[m];
+        // Множители материала подряд: exp по T и строка степенных множителей, общая для всех T
+        const double* exp_row = &exp_T[m * nT];
+        const double* pow_row = &pow_G[m * nG];
+
+        double* out = &r.table[m * nT * nG];
+        for (size_t i = 0; i < nT; i++, out += nG) {
+            double scale = mu0 * exp_row[i];
+            for (size_t k = 0; k < nG; k++) out[k] = scale * pow_row[k];
+        }
+
+        double* curve = &r.mu_T[m * r.G_points.size() * nT];
+        for (size_t gp = 0; gp < r.G_points.size(); gp++) {
+            double power_part = pow_Gp[m * r.G_points.size() + gp];
+            for (size_t i = 0; i < nT; i++) *curve++ = mu0 * exp_row[i] * power_part;
+        }
+        curve = &r.mu_gamma[m * r.T_points.size() * nG];
+        for (size_t tp = 0; tp < r.T_points.size(); tp++) {
+            double scale = mu0 * exp_Tp[m * r.T_points.size() + tp];
+            for (size_t k = 0; k < nG; k++) *curve++ = scale * pow_row[k];
+        }
+    }
+
+    r.time_ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+    return r;
+}
+
+// Ответ сравнения. Первый материал — эталон: ratio = μ/μэт, difference = μ − μэт по всей
+// сетке для каждого из остальных материалов (таблицы — массивы строк T по γ̇).
+string write_comparison(const vector<Material>& materials, const CompareResult& r) {
+    size_t M = r.count, nT = r.axes.T_vals.size(), nG = r.axes.G_vals.size();
+    size_t cells = nT * nG;
+    JsonWriter w(24 * (2 * (M - 1) * cells + r.mu_T.size() + r.mu_gamma.size()) + 1024);
+    w.begin_object();
+    w.key("T_range").numbers(r.axes.T_vals);
+    w.key("gamma_range").numbers(r.axes.G_vals);
+    w.key("T_points").numbers(r.T_points);
+    w.key("G_points").numbers(r.G_points);
+    w.key("reference").value(static_cast<uint64_t>(materials[0].id));
+
+    w.key("materials").begin_array();
+    for (size_t m = 0; m < M; m++) {
+        w.begin_object();
+        w.key("id").value(static_cast<uint64_t>(materials[m].id));
+        w.key("name").value(materials[m].name);
+        w.key("mu_T").begin_array();
+        for (size_t gp = 0; gp < r.G_points.size(); gp++) w.numbers(&r.mu_T[(m * r.G_points.size() + gp) * nT], nT);
+        w.end_array();
+        w.key("mu_gamma").begin_array();
+        for (size_t tp = 0; tp < r.T_points.size(); tp++) w.numbers(&r.mu_gamma[(m * r.T_points.size() + tp) * nG], nG);
+        w.end_array();
+        w.end_object();
+    }
+    w.end_array();
+
+    vector<double> line(nG);
+    for (bool ratio : { true, false }) {
+        w.key(ratio ? "ratio" : "difference").begin_array();
+        for (size_t m = 1; m < M; m++) {
+            w.begin_object();
+            w.key("id").value(static_cast<uint64_t>(materials[m].id));
+            w.key("table").begin_array();
+            for (size_t i = 0; i < nT; i++) {
+                const double* a = r.row(m, i);
+                const double* ref = r.row(0, i);
+                if (ratio) for (size_t k = 0; k < nG; k++) line[k] = a[k] / ref[k];
+                else for (size_t k = 0; k < nG; k++) line[k] = a[k] - ref[k];
+                w.numbers(line);
+            }
+            w.end_array();
+            w.end_object();
+        }
+        w.end_array();
+    }
+
+    w.key("performance").begin_object()
+        .key("time_ms").value(r.time_ms)
+        .key("materials").value(uint64_t{ M })
+        .key("operations").value(uint64_t{ 50 * M * cells })
+        .end_object();
+    w.end_object();
+    return w.take();
+}
+
+// === РАСЧЁТ ПО ТОЧКАМ ===
+// Вязкость в произвольных точках (T, γ̇), например в измеренных, без построения сетки:
+// стоимость растёт с числом точек. Форматы тела:
+//   application/octet-stream — пары float64 (T, γ̇) подряд, little-endian, 16 байт на точку;
+//   application/json — массив пар [[T, γ̇], ...].
+// Двоичное тело читается через ContentReader прямо в массивы T и γ̇, копии тела нет;
+// JSON буферизуется и разбирается SAX-ом в те же массивы, поэтому его предел ниже: большие
+// наборы точек передаются двоичным телом. Ответ идёт потоком в формате запроса: float64 μ
+// на точку или {"materialId":…,"count":…,"mu":[…]}. Блоки по POINTS_BLOCK точек считаются
+// в вычислительном пуле параллельно и отправляются по порядку. Ядра exp/pow и порядок умножений
+// те же, что в compute_grid, поэтому в узле сетки значение совпадает с /api/calculate.
+const size_t POINTS_MAX = 4 * 1024 * 1024;
+const size_t POINTS_BLOCK = 64 * 1024;
+const size_t POINTS_BINARY_BODY_MAX = POINTS_MAX * 16;
+// Пара из допустимой области в кратчайшей записи ([249.99999999999997,999.9999999999999],) —
+// до 40 символов, так что в 64 МиБ помещается не меньше 1,6 млн точек
+const size_t POINTS_JSON_BODY_MAX = 64 * 1024 * 1024;
+
+bool binary_points(const httplib::Request& req) {
+    return req.get_header_value("Content-Type").rfind("application/octet-stream", 0) == 0;
+}
+
+struct PointsRequest {
+    int materialId = 0;
+    static const std::array<BodyField<PointsRequest>, 1> FIELDS;
+};
+const std::array<BodyField<PointsRequest>, 1> PointsRequest::FIELDS = { {
+    {"materialId", &PointsRequest::materialId}
+} };
+
+struct PointSet {
+    vector<double> T, G;
+};
+
+// Множители всего блока считаются векторными exp_block и pow_block, затем перемножаются
+void eval_points(const Material& m, const double* T, const double* G, size_t n, double* out) {
+    vector<double> args(n), exp_part(n);
+    for (size_t i = 0; i < n; i++) args[i] = temp_arg(m, T[i]);
+    exp_block(args.data(), exp_part.data(), n);
+    pow_block(G, m.n - 1.0, out, n);
+    for (size_t i = 0; i < n; i++) out[i] = m.mu0 * exp_part[i] * out[i];
+}
+
+class PointDecoder : public nlohmann::json_sax<json> {
+    PointSet& out;
+    int depth = 0;
+    size_t items = 0;  // чисел в текущей паре
+    double pair[2] = { 0, 0 };
+
+    bool fail(const char* what) {
+        error = what;
+        return false;
+    }
+
+    bool number(double v) {
+        if (depth != 2 || items == 2) return fail("Point must be [T, gamma]");
+        pair[items++] = v;
+        return true;
+    }
+
+public:
+    std::string error;
+
+    explicit PointDecoder(PointSet& o) : out(o) {}
+
+    bool null() override { return fail("Invalid type"); }
+    bool boolean(bool) override { return fail("Invalid type"); }
+    bool number_integer(number_integer_t v) override { return number(static_cast<double>(v)); }
+    bool number_unsigned(number_unsigned_t v) override { return number(static_cast<double>(v)); }
+    bool number_float(number_float_t v, const string_t&) override { return number(v); }
+    bool string(string_t&) override { return fail("Invalid type"); }
+    bool binary(binary_t&) override { return fail("Invalid type"); }
+    bool key(string_t&) override { return fail("Invalid type"); }
+    bool start_object(std::size_t) override { return fail("Invalid type"); }
+    bool end_object() override { return true; }
+
+    bool start_array(std::size_t) override {
+        if (depth == 2) return fail("Point must be [T, gamma]");
+        if (++depth == 2) {
+            if (out.T.size() == POINTS_MAX) return fail("Too many points");
+            items = 0;
+        }
+        return true;
+    }
+    bool end_array() override {
+        if (depth-- == 2) {
+            if (items != 2) return fail("Point must be [T, gamma]");
+            out.T.push_back(pair[0]);
+            out.G.push_back(pair[1]);
+        }
+        return true;
+    }
+
+    bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception&) override {
+        error = "Invalid JSON";
+        return false;
+    }
+};
+
+// Читает точки из тела; при ошибке ответ 400/413 уже сформирован
+bool read_points(const httplib::Request& req, httplib::Response& res, const httplib::ContentReader& reader,
+    bool binary, PointSet& out) {
+    auto reject = [&](int status, const string& error) {
+        res.status = status;
+        res.set_content(json{ {"error", error} }.dump(), "application/json");
+        return false;
+    };
+
+    if (binary) {
+        size_t expected = std::min(req.get_header_value_u64("Content-Length") / 16, POINTS_MAX);
+        out.T.reserve(expected);
+        out.G.reserve(expected);
+        char part[16];
+        size_t have = 0;
+        auto take = [&](const char* rec) {
+            double v[2];
+            memcpy(v, rec, sizeof(v));
+            out.T.push_back(v[0]);
+            out.G.push_back(v[1]);
+        };
+        bool ok = reader([&](const char* data, size_t len) {
+            if (have) {
+                size_t k = std::min(sizeof(part) - have, len);
+                memcpy(part + have, data, k);
+                have += k;
+                data += k;
+                len -= k;
+                if (have < sizeof(part)) return true;
+                take(part);
+                have = 0;
+            }
+            for (; len >= sizeof(part); data += sizeof(part), len -= sizeof(part)) take(data);
+            memcpy(part, data, len);
+            have = len;
+            return out.T.size() <= POINTS_MAX;
+        });
+        if (out.T.size() > POINTS_MAX) return reject(413, "Too many points");
+        if (!ok) return reject(400, "Invalid body");
+        if (have) return reject(400, "Body size must be a multiple of 16 bytes");
+    }
+    else {
+        std::string body;
+        bool too_large = false;
+        bool ok = reader([&](const char* data, size_t len) {
+            too_large = body.size() + len > POINTS_JSON_BODY_MAX;
+            if (!too_large) body.append(data, len);
+            return !too_large;
+        });
+        if (too_large) return reject(413, "Request too large");
+        if (!ok) return reject(400, "Invalid body");
+        PointDecoder decoder(out);
+        if (!json::sax_parse(body, &decoder) || !decoder.error.empty()) {
+            return reject(decoder.error == "Too many points" ? 413 : 400, decoder.error.empty() ? "Invalid JSON" : decoder.error);
+        }
+    }
+
+    if (out.T.empty()) return reject(400, "No points");
+    // Та же область, что у CalcRequest::valid(); NaN не проходит сравнения
+    for (size_t i = 0; i < out.T.size(); i++) {
+        if (!(out.T[i] >= 100 && out.T[i] <= 250 && out.G[i] >= 1 && out.G[i] <= 1000)) {
+            return reject(400, "Точка " + to_string(i) + " вне допустимого диапазона");
+        }
+    }
+    return true;
+}
+
+struct PointStats {
+    std::atomic<uint64_t> requests{ 0 }, binary{ 0 }, points{ 0 }, eval_us{ 0 };
+
+    json metrics() const {
+        return {
+            {"requests", requests.load()},
+            {"binary", binary.load()},
+            {"points", points.load()},
+            {"eval_ms", eval_us.load() / 1000.0}
+        };
+    }
+};
+
+PointStats point_stats;
+
+class PointStream {
+    Material m;
+    std::shared_ptr<const PointSet> pts;
+    vector<double> mu;
+    vector<std::future<void>> blocks;
+    bool binary;
+    size_t next = 0;
+
+public:
+    PointStream(const Material& material, std::shared_ptr<const PointSet> points, bool bin)
+        : m(material), pts(std::move(points)), mu(pts->T.size()), binary(bin) {
+        size_t n = mu.size();
+        for (size_t from = 0; from < n; from += POINTS_BLOCK) {
+            size_t count = std::min(POINTS_BLOCK, n - from);
+            blocks.push_back(compute_executor->submit([this, from, count] {
+                auto start = chrono::steady_clock::now();
+                eval_points(m, &pts->T[from], &pts->G[from], count, &mu[from]);
+                point_stats.eval_us += static_cast<uint64_t>(
+                    chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count());
+            }));
+        }
+        point_stats.requests++;
+        point_stats.points += n;
+        if (binary) point_stats.binary++;
+    }
+
+    // Блоки пишут в mu: при обрыве соединения ждём их, прежде чем освобождать память
+    ~PointStream() {
+        for (auto& b : blocks) {
+            if (b.valid()) b.wait();
+        }
+    }
+
+    bool step(httplib::DataSink& sink) {
+        size_t n = mu.size();
+        string out;
+        if (next == 0 && !binary) {
+            out += "{\"materialId\":";
+            out += to_string(m.id);
+            out += ",\"count\":";
+            out += to_string(n);
+            out += ",\"mu\":[";
+        }
+        size_t from = next * POINTS_BLOCK;
+        size_t count = std::min(POINTS_BLOCK, n - from);
+        try {
+            blocks[next].get();
+        }
+        catch (const std::exception& e) {
+            std::cerr << "POINTS ERROR: " << e.what() << std::endl;
+            return false;
+        }
+        next++;
+        if (binary) {
+            if (!sink.write(reinterpret_cast<const char*>(&mu[from]), count * sizeof(double))) return false;
+        }
+        else {
+            out.reserve(out.size() + count * NUMBER_CHARS_MAX);
+            for (size_t i = from; i < from + count; i++) {
+                if (i) out += ',';
+                append_shortest(out, mu[i]);
+            }
+            if (next == blocks.size()) out += "]}";
+            if (!sink.write(out.data(), out.size())) return false;
+        }
+        if (next == blocks.size()) sink.done();
+        return true;
+    }
+};
+
+// === ПОТОКОВЫЙ РАСЧЁТ (Server-Sent Events) ===
+// GET /api/calculate/stream отдаёт результат частями по мере расчёта:
+//   meta   — оси и опорные точки (T_range, gamma_range, T_points, G_points, rows);
+//   curves — mu_T и mu_gamma, по ним сразу строятся графики;
+//   rows   — строки таблицы пачками {"from": i, "rows": [[μ по gamma_range], ...]};
+//   done   — report_url и performance; error — {"error": ...}.
+// meta строится из осей без расчёта и уходит сразу. Кривые и каждая пачка строк считаются
+// и сериализуются в вычислительном пуле; поток HTTP только пишет готовые события.
+// Перед каждой пачкой проверяется соединение — отключение клиента обрывает расчёт.
+// С одинаковыми расчётами поток не сливается: клиент получает строки по мере расчёта,
+// а общая с ними часть (exp/pow по узлам осей) — O(nT + nG) против O(nT × nG) строк.
+const size_t SSE_ROW_VALUES = 4096;  // значений в одном событии rows
+
+// Проверка параметров и поиск материала в снимке каталога; при ошибке ответ уже сформирован
+bool find_material(int id, httplib::Response& res, Material& out) {
+    // Коэффициенты берутся из снимка каталога — соединение из пула не нужно
+    auto catalog = material_catalog.acquire();
+    if (!catalog) {
+        res.status = 500;
+        res.set_content(json{ {"error", "DB unavailable"} }.dump(), "application/json");
+        return false;
+    }
+
+    const Material* material = catalog->find(id);
+    if (!material) {
+        res.status = 404;
+        res.set_content(json{ {"error", "Материал не найден"} }.dump(), "application/json");
+        return false;
+    }
+    out = *material;
+    return true;
+}
+
+bool resolve_calc(const CalcRequest& p, httplib::Response& res, Material& out) {
+    if (!p.valid()) {
+        res.status = 400;
+        res.set_content(json{ {"error", "Значения введены неверно"} }.dump(), "application/json");
+        return false;
+    }
+    return find_material(p.materialId, res, out);
+}
+
+bool send_event(httplib::DataSink& sink, const char* event, const string& data) {
+    string frame;
+    frame.reserve(data.size() + 32);
+    frame += "event: ";
+    frame += event;
+    frame += "\ndata: ";
+    frame += data;
+    frame += "\n\n";
+    return sink.write(frame.data(), frame.size());
+}
+
+class CalcStream {
+    enum class Stage { Meta, Curves, Rows, Done };
+
+    Material m;
+    CalcRequest p;
+    GridAxes axes;
+    GridPlan plan;
+    CalcResult r;
+    Stage stage = Stage::Meta;
+    size_t next_row = 0, rows_per_event = 1;
+    chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
+    template <class F>
+    auto run(F fn) { return compute_executor->submit(std::move(fn)).get(); }
+
+    bool meta(httplib::DataSink& sink) {
+        axes = make_axes(p);
+        curve_points(p, r);
+        rows_per_event = std::max<size_t>(1, SSE_ROW_VALUES / std::max<size_t>(1, axes.G_vals.size()));
+
+        JsonWriter w;
+        w.begin_object();
+        w.key("T_range").numbers(axes.T_vals);
+        w.key("gamma_range").numbers(axes.G_vals);
+        w.key("T_points").numbers(r.T_points);
+        w.key("G_points").numbers(r.G_points);
+        w.key("rows").value(uint64_t{ axes.T_vals.size() });
+        w.end_object();
+        stage = Stage::Curves;
+        return send_event(sink, "meta", w.take());
+    }
+
+    bool curves(httplib::DataSink& sink) {
+        string data = run([this] {
+            plan = plan_grid(m, axes);
+            compute_curves(m, p, plan, r);
+            r.table.resize(plan.T_vals.size() * plan.G_vals.size());
+
+            size_t nT = plan.T_vals.size(), nG = plan.G_vals.size();
+            JsonWriter w;
+            w.begin_object();
+            w.key("mu_T").begin_array();
+            for (size_t i = 0; i < r.G_points.size(); i++) w.numbers(&r.mu_T[i * nT], nT);
+            w.end_array();
+            w.key("mu_gamma").begin_array();
+            for (size_t i = 0; i < r.T_points.size(); i++) w.numbers(&r.mu_gamma[i * nG], nG);
+            w.end_array();
+            w.end_object();
+            return w.take();
+        });
+        stage = Stage::Rows;
+        return send_event(sink, "curves", data);
+    }
+
+    bool rows(httplib::DataSink& sink) {
+        if (!sink.is_writable()) return false;
+        size_t nT = plan.T_vals.size(), nG = plan.G_vals.size();
+        size_t from = next_row, to = std::min(nT, from + rows_per_event);
+        string data = run([this, from, to, nG] {
+            fill_rows(m, plan, from, to, &r.table[from * nG]);
+
+            JsonWriter w(24 * (to - from) * nG + 64);
+            w.begin_object();
+            w.key("from").value(uint64_t{ from });
+            w.key("rows").begin_array();
+            for (size_t i = from; i < to; i++) w.numbers(&r.table[i * nG], nG);
+            w.end_array();
+            w.end_object();
+            return w.take();
+        });
+        next_row = to;
+        if (next_row == nT) stage = Stage::Done;
+        return send_event(sink, "rows", data);
+    }
+
+    bool done(httplib::DataSink& sink) {
+        // CSV не пишется: отчёт строится при скачивании из сетки, переданной в реестр
+        uint64_t cells = r.table.size();
+        r.T_vals = std::move(plan.T_vals);
+        r.G_vals = std::move(plan.G_vals);
+        string report_url = report_registry.add(m, p, std::make_shared<const CalcResult>(std::move(r)));
+        double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+
+        JsonWriter w;
+        w.begin_object();
+        w.key("report_url").value(report_url);
+        w.key("performance").begin_object()
+            .key("time_ms").value(elapsed)
+            .key("operations").value(50 * cells)
+            .end_object();
+        w.end_object();
+        if (!send_event(sink, "done", w.take())) return false;
+        sink.done();
+        return true;
+    }
+
+public:
+    CalcStream(const Material& material, const CalcRequest& params) : m(material), p(params) {}
+
+    // Один шаг на вызов провайдера httplib
+    bool step(httplib::DataSink& sink) {
+        try {
+            switch (stage) {
+            case Stage::Meta: return meta(sink);
+            case Stage::Curves: return curves(sink);
+            case Stage::Rows: return rows(sink);
+            case Stage::Done: return done(sink);
+            }
+        }
+        catch (const std::exception& e) {
+            std::cerr << "CALC STREAM ERROR: " << e.what() << std::endl;
+            send_event(sink, "error", json{ {"error", "Ошибка расчёта"} }.dump());
+        }
+        return false;
+    }
+};
+
+// === АРХИВ ОТЧЁТОВ (ZIP) ===
+// Несколько отчётов одним архивом, который собирается на лету в chunked-ответе. У каждой записи
+// сначала идёт локальный заголовок без CRC и размеров (флаг 3), потом данные, потом дескриптор
+// с CRC и размерами. В конце архива — центральный каталог. В памяти одновременно одна сетка
+// и один фрагмент CSV, на диск ничего не пишется. Готовые отчёты читаются из хранилища,
+// остальные строятся из сетки (из кэша или пересчётом). Записи сжимаются deflate (если собрано
+// с EXTRUSION_ZLIB); без zlib или при ?method=store данные хранятся как есть.
+// ZIP64 не поддерживается: если запись или архив больше 4 ГиБ, ответ прерывается.
+const size_t ZIP_ENTRIES_MAX = 32;
+const uint64_t ZIP_SIZE_MAX = 0xFFFFFFFFull;
+
+uint32_t crc32_update(uint32_t crc, const char* data, size_t len) {
+#ifdef EXTRUSION_ZLIB
+    return static_cast<uint32_t>(crc32(crc, reinterpret_cast<const Bytef*>(data), static_cast<uInt>(len)));
+#else
+    static const auto table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+#endif
+}
+
+// Имя записи: материал и ключ отчёта; символы, недопустимые в именах файлов, заменяются на _
+string zip_entry_name(const string& material, const string& key) {
+    string name;
+    for (char c : material) {
+        bool bad = static_cast<unsigned char>(c) < 0x20 || string_view("\\/:*?\"<>|").find(c) != string_view::npos;
+        name += bad ? '_' : c;
+    }
+    if (name.empty()) name = "report";
+    return name + "_" + key + ".csv";
+}
+
+struct ZipStats {
+    std::atomic<uint64_t> archives{ 0 }, entries{ 0 }, from_store{ 0 }, bytes_in{ 0 }, bytes_out{ 0 }, aborted{ 0 };
+
+    json metrics() const {
+        uint64_t in = bytes_in.load(), out = bytes_out.load();
+        return {
+            {"archives", archives.load()},
+            {"entries", entries.load()},
+            {"from_store", from_store.load()},
+            {"bytes_in", in},
+            {"bytes_out", out},
+            {"ratio", in ? static_cast<double>(out) / static_cast<double>(in) : 0.0},
+            {"aborted", aborted.load()}
+        };
+    }
+};
+
+ZipStats zip_stats;
+
+class ZipReportStream {
+public:
+    struct Entry {
+        ReportRegistry::Spec spec;
+        string key, name;
+    };
+
+private:
+    vector<Entry> entries;
+    bool deflate;
+    uint16_t dos_time = 0, dos_date = 0;
+    size_t index = 0;
+    uint64_t offset = 0;  // отправлено байт архива
+    string central;
+
+    // Текущая запись
+    bool started = false;
+    std::shared_ptr<const CalcResult> grid;
+    std::ifstream file;
+    size_t next_row = 0;
+    uint32_t crc = 0;
+    uint64_t raw_size = 0, packed_size = 0, entry_offset = 0;
+    std::unique_ptr<StreamCompressor> compressor;
+
+    static void put16(string& out, uint32_t v) {
+        out += static_cast<char>(v & 0xFF);
+        out += static_cast<char>((v >> 8) & 0xFF);
+    }
+    static void put32(string& out, uint32_t v) {
+        put16(out, v & 0xFFFF);
+        put16(out, v >> 16);
+    }
+
+    // Версия 2.0; флаги: CRC и размеры в дескрипторе (бит 3), имя в UTF-8 (бит 11)
+    void put_common(string& out) const {
+        put16(out, 20);
+        put16(out, 0x0008 | 0x0800);
+        put16(out, deflate ? 8 : 0);
+        put16(out, dos_time);
+        put16(out, dos_date);
+    }
 
-// === ПУЛ СОЕДИНЕНИЙ (thread-safe) ===
-class DBPool {
-private:
-    std::vector<PGconn*> pool;
-    std::mutex pool_mutex;
-    const char* conninfo;
+    void begin_entry(string& out) {
+        const Entry& e = entries[index];
+        entry_offset = offset + out.size();
+        put32(out, 0x04034b50);
+        put_common(out);
+        put32(out, 0);
+        put32(out, 0);
+        put32(out, 0);
+        put16(out, static_cast<uint32_t>(e.name.size()));
+        put16(out, 0);
+        out += e.name;
 
-    void configure_conn(PGconn* conn) {
-        if (conn && PQstatus(conn) == CONNECTION_OK) {
-            PQsetNoticeReceiver(conn, nullptr, nullptr);
-            PQsetErrorVerbosity(conn, PGVerbosity(0));  // TERSE
+        if (auto path = report_store->locate(e.key)) file.open(*path, std::ios::binary);
+        if (file.is_open()) zip_stats.from_store++;
+        else grid = report_registry.grid(e.key, e.spec);
+        next_row = 0;
+        crc = 0;
+        raw_size = packed_size = 0;
+#ifdef EXTRUSION_ZLIB
+        if (deflate) compressor = std::make_unique<GzipStream>(response_compressor->deflate_level(), -15);
+#endif
+        started = true;
+    }
+
+    // Следующий фрагмент CSV в raw; true — это последний фрагмент записи
+    bool next_chunk(string& raw) {
+        if (file.is_open()) {
+            raw.resize(CSV_CHUNK_BYTES);
+            file.read(&raw[0], static_cast<std::streamsize>(raw.size()));
+            raw.resize(static_cast<size_t>(file.gcount()));
+            if (file.bad()) throw std::runtime_error("report read failed");
+            return file.eof();
         }
+        if (next_row == 0 && raw_size == 0) csv_header(*grid, raw);
+        next_row = csv_rows(*grid, next_row, raw);
+        return next_row == grid->T_vals.size();
+    }
+
+    void end_entry(string& out) {
+        const Entry& e = entries[index];
+        put32(out, 0x08074b50);
+        put32(out, crc);
+        put32(out, static_cast<uint32_t>(packed_size));
+        put32(out, static_cast<uint32_t>(raw_size));
+
+        put32(central, 0x02014b50);
+        put16(central, 20);  // создано: MS-DOS, версия 2.0
+        put_common(central);
+        put32(central, crc);
+        put32(central, static_cast<uint32_t>(packed_size));
+        put32(central, static_cast<uint32_t>(raw_size));
+        put16(central, static_cast<uint32_t>(e.name.size()));
+        put16(central, 0);  // extra
+        put16(central, 0);  // комментарий
+        put16(central, 0);  // номер диска
+        put16(central, 0);  // внутренние атрибуты
+        put32(central, 0);  // внешние атрибуты
+        put32(central, static_cast<uint32_t>(entry_offset));
+        central += e.name;
+
+        zip_stats.entries++;
+        zip_stats.bytes_in += raw_size;
+        started = false;
+        grid.reset();
+        file.close();
+        compressor.reset();
+        index++;
+    }
+
+    void end_archive(string& out) {
+        uint64_t central_offset = offset + out.size();
+        out += central;
+        put32(out, 0x06054b50);
+        put16(out, 0);
+        put16(out, 0);
+        put16(out, static_cast<uint32_t>(entries.size()));
+        put16(out, static_cast<uint32_t>(entries.size()));
+        put32(out, static_cast<uint32_t>(central.size()));
+        put32(out, static_cast<uint32_t>(central_offset));
+        put16(out, 0);
+    }
+
+    bool send(httplib::DataSink& sink, const string& out) {
+        if (offset + out.size() > ZIP_SIZE_MAX) {
+            zip_stats.aborted++;
+            return false;
+        }
+        if (out.empty()) return true;  // пустой фрагмент httplib записал бы как конец chunked-ответа
+        offset += out.size();
+        zip_stats.bytes_out += out.size();
+        return sink.write(out.data(), out.size());
     }
 
 public:
-    DBPool(const char* ci, size_t size = 5) : conninfo(ci) {
-        for (size_t i = 0; i < size; ++i) {
-            PGconn* conn = PQconnectdb(conninfo);
-            if (PQstatus(conn) == CONNECTION_OK) {
-                configure_conn(conn);
-                pool.push_back(conn);
+    // Без zlib deflate недоступен, записи хранятся без сжатия
+#ifdef EXTRUSION_ZLIB
+    static constexpr bool deflate_available = true;
+#else
+    static constexpr bool deflate_available = false;
+#endif
+
+    ZipReportStream(vector<Entry> list, bool use_deflate)
+        : entries(std::move(list)), deflate(use_deflate && deflate_available) {
+        // Время записей — UTC в формате MS-DOS (секунды с шагом 2)
+        auto now = chrono::system_clock::now();
+        auto day = chrono::floor<chrono::days>(now);
+        chrono::year_month_day ymd{ day };
+        chrono::hh_mm_ss<chrono::seconds> hms{ chrono::floor<chrono::seconds>(now - day) };
+        dos_date = static_cast<uint16_t>(((static_cast<int>(ymd.year()) - 1980) << 9) |
+            (static_cast<unsigned>(ymd.month()) << 5) | static_cast<unsigned>(ymd.day()));
+        dos_time = static_cast<uint16_t>((hms.hours().count() << 11) | (hms.minutes().count() << 5) |
+            (hms.seconds().count() / 2));
+        zip_stats.archives++;
+    }
+
+    // Одна запись заголовка/фрагмента на вызов провайдера httplib
+    bool step(httplib::DataSink& sink) {
+        try {
+            string out;
+            if (index == entries.size()) {
+                end_archive(out);
+                if (!send(sink, out)) return false;
+                sink.done();
+                return true;
             }
-            else {
-                std::cerr << "Failed to create connection " << i << ": " << PQerrorMessage(conn) << std::endl;
-                PQfinish(conn);
+            if (!started) begin_entry(out);
+
+            string raw;
+            raw.reserve(CSV_CHUNK_BYTES + 4096);
+            bool last = next_chunk(raw);
+            crc = crc32_update(crc, raw.data(), raw.size());
+            raw_size += raw.size();
+
+            size_t before = out.size();
+            if (compressor) {
+                if (!compressor->write(raw.data(), raw.size(), last ? FlushMode::Finish : FlushMode::None, out)) {
+                    throw std::runtime_error("deflate failed");
+                }
             }
+            else out += raw;
+            packed_size += out.size() - before;
+            if (raw_size > ZIP_SIZE_MAX || packed_size > ZIP_SIZE_MAX) {
+                zip_stats.aborted++;
+                return false;
+            }
+            if (last) end_entry(out);
+            return send(sink, out);
+        }
+        catch (const std::exception& e) {
+            std::cerr << "ZIP STREAM ERROR: " << e.what() << std::endl;
+            zip_stats.aborted++;
         }
+        return false;
     }
+};
 
-    ~DBPool() {
-        for (auto conn : pool) {
-            if (conn) PQfinish(conn);
+// === РАЗМЕР ТЕЛА ЗАПРОСА ===
+// Наибольшее тело, которое сервер вообще читает (set_payload_max_length)
+const size_t REQUEST_PAYLOAD_MAX = std::max(POINTS_BINARY_BODY_MAX, POINTS_JSON_BODY_MAX);
+
+// Наибольшее тело для маршрута. Проверяется по Content-Length в pre-routing, до того как
+// httplib прочитает тело в память. Чтение потоком (ContentReader) есть только у расчёта по точкам;
+// остальные маршруты буферизуют тело целиком, и самое большое из них — список read_body_list.
+bool streams_body(const string& path) { return path == "/api/calculate/points"; }
+
+size_t request_body_limit(const httplib::Request& req) {
+    if (streams_body(req.path)) return binary_points(req) ? POINTS_BINARY_BODY_MAX : POINTS_JSON_BODY_MAX;
+    return REQUEST_BODY_MAX * std::max({ ZIP_ENTRIES_MAX, BATCH_JOBS_MAX, COMPARE_MATERIALS_MAX });
+}
+
+// === КЭШ СТАТИКИ ===
+// Файлы ./web загружаются в память при старте и сразу сжимаются (gzip и brotli с максимальным
+// уровнем — один раз на версию файла). Ответ выбирается по Accept-Encoding, ETag — хэш содержимого.
+// Фоновый поток раз в несколько секунд сверяет время изменения и размер файлов и публикует
+// новый снимок так же, как каталог материалов; сами запросы к файловой системе не обращаются.
+
+struct StaticAsset {
+    string content_type;
+    string cache_control;
+    string etag;  // без кавычек; для сжатых вариантов добавляется суффикс
+    string identity, gzip, brotli;
+    fs::file_time_type mtime;
+    uintmax_t size = 0;
+};
+
+using StaticSnapshot = std::unordered_map<string, std::shared_ptr<const StaticAsset>>;
+
+class StaticCache {
+private:
+    const fs::path root;
+    const uintmax_t max_file_size = 16 * 1024 * 1024;
+    std::atomic<std::shared_ptr<const StaticSnapshot>> current;
+    std::atomic<uint64_t> hits{ 0 }, not_modified{ 0 }, reloads{ 0 };
+    std::atomic<uint64_t> sent_identity{ 0 }, sent_gzip{ 0 }, sent_brotli{ 0 };
+
+    std::thread watcher;
+    std::mutex stop_mutex;
+    std::condition_variable stop_cv;
+    bool stopping = false;
+
+    std::shared_ptr<const StaticAsset> load(const fs::path& file, fs::file_time_type mtime, uintmax_t size) const {
+        ifstream in(file, std::ios::binary);
+        if (!in) return nullptr;
+        auto asset = std::make_shared<StaticAsset>();
+        asset->identity.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        asset->mtime = mtime;
+        asset->size = size;
+        asset->content_type = httplib::detail::find_content_type(file.string(), {}, "application/octet-stream");
+        asset->cache_control = file.extension() == ".html" ? "no-cache" : "public, max-age=86400";
+        asset->etag = sha256_hex(asset->identity, 16);
+
+        // Сжатый вариант храним, только если он заметно меньше исходного
+        string gz = gzip_compress(asset->identity, 9);
+        if (!gz.empty() && gz.size() < asset->identity.size() * 9 / 10) asset->gzip = std::move(gz);
+        string br = brotli_compress(asset->identity, 11);
+        if (!br.empty() && br.size() < asset->identity.size() * 9 / 10) asset->brotli = std::move(br);
+        return asset;
+    }
+
+    // Собирает новый снимок, переиспользуя неизменившиеся файлы; true — что-то изменилось
+    bool refresh() {
+        auto old = current.load();
+        auto next = std::make_shared<StaticSnapshot>();
+        bool changed = false;
+
+        std::error_code ec;
+        for (fs::recursive_directory_iterator it(root, ec), end; !ec && it != end; it.increment(ec)) {
+            if (!it->is_regular_file(ec)) continue;
+            auto mtime = it->last_write_time(ec);
+            auto size = it->file_size(ec);
+            if (ec || size > max_file_size) continue;
+
+            string url = "/" + fs::relative(it->path(), root, ec).generic_string();
+            if (ec) continue;
+            std::shared_ptr<const StaticAsset> asset;
+            if (old) {
+                auto found = old->find(url);
+                if (found != old->end() && found->second->mtime == mtime && found->second->size == size) {
+                    asset = found->second;
+                }
+            }
+            if (!asset) {
+                asset = load(it->path(), mtime, size);
+                if (!asset) continue;
+                changed = true;
+            }
+            (*next)[url] = asset;
         }
+        if (!old || old->size() != next->size()) changed = true;
+        if (changed) {
+            current.store(std::move(next));
+            reloads++;
+        }
+        return changed;
     }
 
-    PGconn* get() {
-        std::lock_guard<std::mutex> lock(pool_mutex);
-        if (pool.empty()) return nullptr;
-        PGconn* conn = pool.back();
-        pool.pop_back();
-        return conn;
+public:
+    explicit StaticCache(const string& dir) : root(dir) {
+        refresh();
+        watcher = std::thread([this] {
+            std::unique_lock<std::mutex> lock(stop_mutex);
+            while (!stop_cv.wait_for(lock, chrono::seconds(2), [&] { return stopping; })) {
+                lock.unlock();
+                refresh();
+                lock.lock();
+            }
+        });
     }
 
-    void put(PGconn* conn) {
-        if (!conn) return;
-        if (PQstatus(conn) != CONNECTION_OK) {
-            PQfinish(conn);
-            conn = PQconnectdb(conninfo);
+    ~StaticCache() {
+        {
+            std::lock_guard<std::mutex> lock(stop_mutex);
+            stopping = true;
         }
-        configure_conn(conn);
-        if (conn && PQstatus(conn) == CONNECTION_OK) {
-            std::lock_guard<std::mutex> lock(pool_mutex);
-            pool.push_back(conn);
+        stop_cv.notify_all();
+        watcher.join();
+    }
+
+    // true — ответ сформирован из кэша; false — файла в кэше нет
+    bool serve(const httplib::Request& req, httplib::Response& res) {
+        auto snap = current.load();
+        if (!snap) return false;
+        string path = req.path;
+        if (!path.empty() && path.back() == '/') path += "index.html";
+        auto found = snap->find(path);
+        if (found == snap->end()) return false;
+        const StaticAsset& asset = *found->second;
+
+        Encoding enc = negotiate_encoding(req);
+        if (enc == Encoding::Brotli && asset.brotli.empty()) enc = asset.gzip.empty() ? Encoding::Identity : Encoding::Gzip;
+        if (enc == Encoding::Gzip && asset.gzip.empty()) enc = Encoding::Identity;
+
+        // У каждого представления свой сильный ETag
+        string etag = "\"" + asset.etag + (enc == Encoding::Identity ? "" : string("-") + encoding_name(enc)) + "\"";
+        res.set_header("ETag", etag);
+        res.set_header("Cache-Control", asset.cache_control);
+        res.set_header("Vary", "Accept-Encoding");
+        hits++;
+        if (req.has_header("If-None-Match") && etag_matches(req.get_header_value("If-None-Match"), etag)) {
+            res.status = 304;
+            not_modified++;
+            return true;
+        }
+
+        // Статус задаётся явно, чтобы httplib не применял Range к сжатому телу
+        res.status = 200;
+        if (enc == Encoding::Brotli) {
+            res.set_header("Content-Encoding", "br");
+            res.set_content(asset.brotli, asset.content_type);
+            sent_brotli += asset.brotli.size();
+        }
+        else if (enc == Encoding::Gzip) {
+            res.set_header("Content-Encoding", "gzip");
+            res.set_content(asset.gzip, asset.content_type);
+            sent_gzip += asset.gzip.size();
         }
         else {
-            if (conn) PQfinish(conn);
+            res.set_content(asset.identity, asset.content_type);
+            sent_identity += asset.identity.size();
         }
+        return true;
     }
-};
 
-// Глобальный пул
-std::unique_ptr<DBPool> db_pool;
+    json metrics() const {
+        auto snap = current.load();
+        uintmax_t bytes = 0;
+        if (snap) {
+            for (const auto& entry : *snap) {
+                bytes += entry.second->identity.size() + entry.second->gzip.size() + entry.second->brotli.size();
+            }
+        }
+        return {
+            {"files", snap ? snap->size() : 0},
+            {"memory_bytes", bytes},
+            {"reloads", reloads.load()},
+            {"hits", hits.load()},
+            {"not_modified", not_modified.load()},
+            {"sent_bytes", { {"identity", sent_identity.load()}, {"gzip", sent_gzip.load()}, {"br", sent_brotli.load()} }}
+        };
+    }
+};
 
-// === УТИЛИТЫ ===
-auto safe_escape = [](PGconn* conn, const string& s) -> string {
-    if (s.empty()) return "NULL";
-    char* esc = PQescapeLiteral(conn, s.c_str(), s.size());
-    if (!esc) return "NULL";
-    string result = esc;
-    PQfreemem(esc);
-    return result;
-    };
+std::unique_ptr<StaticCache> static_cache;
 
 int main() {
     const char* conninfo = "host=localhost port=5432 dbname=extrusion_db user=postgres password=12345";
@@ -109,23 +4403,84 @@ int main() {
     db_pool->put(db_pool->get());  // Тест
     std::cout << "Подключено к extrusion_db! Пул: 5 соединений." << std::endl;
 
+    if (!material_catalog.reload()) {
+        std::cerr << "WARNING: Не удалось загрузить каталог материалов, повтор при первом запросе" << std::endl;
+    }
+
+    password_hasher = std::make_unique<PasswordHasher>();
+    compute_executor = std::make_unique<ComputeExecutor>(
+        static_cast<size_t>(env_long("EXTRUSION_COMPUTE_THREADS", std::thread::hardware_concurrency())),
+        env_long("EXTRUSION_COMPUTE_PIN", 1) != 0);
+
     httplib::Server svr;
-    svr.set_base_dir("./web");
 
-    // === АВТОРИЗАЦИЯ ===
-    svr.Post("/api/login", [&](const httplib::Request& req, httplib::Response& res) {
+    // Не меньше 4: классам каталога и тяжёлых запросов нужен хотя бы один поток, и ещё один
+    // остаётся за интерактивными
+    size_t http_threads = static_cast<size_t>(std::max(4L, env_long("EXTRUSION_HTTP_THREADS",
+        std::max(8L, static_cast<long>(std::thread::hardware_concurrency())))));
+    size_t http_backlog = static_cast<size_t>(env_long("EXTRUSION_HTTP_BACKLOG", 1024));
+    request_scheduler = std::make_unique<RequestScheduler>(http_threads);
+    svr.new_task_queue = [http_threads, http_backlog] {
+        auto* queue = new WorkStealingQueue(http_threads, http_backlog);
+        http_task_queue = queue;
+        return queue;
+    };
+    // Статика отдаётся из памяти (pre-routing ниже); base_dir — запасной путь для файлов,
+    // которые ещё не попали в снимок
+    static_cache = std::make_unique<StaticCache>("./web");
+    report_store = std::make_unique<ReportStore>("./reports");
+    report_registry.configure();
+    report_jobs = std::make_unique<ReportJobs>();
+    response_compressor = std::make_unique<ResponseCompressor>();
+    svr.set_base_dir("./web");
 
-        json j;
+    // === СТАТИКА, РАЗМЕР ТЕЛА И ОГРАНИЧЕНИЕ ЧАСТОТЫ ===
+    // Pre-routing выполняется до чтения тела: слишком большое тело отклоняется по Content-Length,
+    // не попадая в память. Тело без длины (chunked) принимается только маршрутами, читающими
+    // его потоком; для всех остальных — 411. Общий предел httplib — REQUEST_PAYLOAD_MAX.
+    // Для API ключ клиента — действующая сессия, иначе адрес
+    svr.set_payload_max_length(REQUEST_PAYLOAD_MAX);
+    svr.set_pre_routing_handler([&](const httplib::Request& req, httplib::Response& res) {
+        if (req.path.rfind("/api/", 0) != 0) {
+            if ((req.method == "GET" || req.method == "HEAD") && static_cache->serve(req, res)) {
+                return httplib::Server::HandlerResponse::Handled;
+            }
+            return httplib::Server::HandlerResponse::Unhandled;
+        }
 
-        try { 
-            j = json::parse(req.body); 
+        if (req.has_header("Content-Length")) {
+            if (req.get_header_value_u64("Content-Length") > request_body_limit(req)) {
+                res.status = 413;
+                res.set_content(json{ {"error", "Request too large"} }.dump(), "application/json");
+                return httplib::Server::HandlerResponse::Handled;
+            }
         }
-        catch (...) { res.status = 400; 
-        res.set_content(json{ {"error", "Invalid JSON"} }.dump(), "application/json");
-        return;
+        else if (req.has_header("Transfer-Encoding") && !streams_body(req.path)) {
+            res.status = 411;
+            res.set_content(json{ {"error", "Content-Length required"} }.dump(), "application/json");
+            return httplib::Server::HandlerResponse::Handled;
+        }
+
+        string token = session_token(req);
+        string client = (!token.empty() && sessions.find(token)) ? "s:" + token : "a:" + req.remote_addr;
+        uint32_t retry_after = 0;
+        if (rate_limiter.allow(req.method, req.path, client, retry_after)) {
+            return httplib::Server::HandlerResponse::Unhandled;
         }
+        res.status = 429;
+        res.set_header("Retry-After", to_string(retry_after));
+        res.set_content(json{ {"error", "Слишком много запросов"} }.dump(), "application/json");
+        return httplib::Server::HandlerResponse::Handled;
+        });
+
+    // === АВТОРИЗАЦИЯ ===
+    svr.Post("/api/login", classed(ReqClass::Interactive, [&](const httplib::Request& req, httplib::Response& res) {
 
-        string login = j.value("login", ""), password = j.value("password", "");
+        LoginRequest body;
+        if (!read_body(req, res, body)) return;
+
+        const string& login = body.login;
+        const string& password = body.password;
         if (login.empty() || password.empty()) {
             res.status = 400;
             res.set_content(json{ {"error", "Empty login/password"} }.dump(), "application/json");
@@ -140,24 +4495,61 @@ int main() {
         }
 
         string esc_l = safe_escape(conn, login);
-        string esc_p = safe_escape(conn, password);
-        string q = "SELECT role FROM users WHERE login = " + esc_l + " AND password = " + esc_p;
+        string q = "SELECT password, role FROM users WHERE login = " + esc_l;
 
         PGresult* r = PQexec(conn, q.c_str());
         PQconsumeInput(conn);
 
-        if (PQresultStatus(r) == PGRES_TUPLES_OK && PQntuples(r) > 0) {
-            res.set_content(json{ {"success", true}, {"role", PQgetvalue(r, 0, 0)} }.dump(), "application/json");
+        bool found = PQresultStatus(r) == PGRES_TUPLES_OK && PQntuples(r) > 0;
+        string stored = found ? PQgetvalue(r, 0, 0) : "";
+        string role = found ? PQgetvalue(r, 0, 1) : "";
+        PQclear(r);
+        db_pool->put(conn);  // соединение не держим, пока считается хэш
+
+        auto check = found ? password_hasher->verify(password, stored) : password_hasher->verify_unknown(password);
+        if (check.status == PasswordHasher::Status::Busy) {
+            res.status = 503;
+            res.set_header("Retry-After", "1");
+            res.set_content(json{ {"error", "Сервер перегружен, повторите вход"} }.dump(), "application/json");
+            return;
         }
-        else {
+        if (!check.match) {
             res.status = 401; res.set_content(json{ {"success", false} }.dump(), "application/json");
+            return;
         }
-        PQclear(r);
-        db_pool->put(conn);
-        });
+
+        // Старый открытый пароль или другое число итераций — перехэшируем в фоне.
+        // Условие на прежнее значение: если пароль успели сменить, новый не затираем.
+        if (check.needs_rehash) {
+            password_hasher->post([login, password, stored] {
+                string hashed = password_hasher->encode(password);
+                PGconn* c = db_pool->get();
+                if (!c) return;
+                string uq = "UPDATE users SET password = " + safe_escape(c, hashed) +
+                    " WHERE login = " + safe_escape(c, login) + " AND password = " + safe_escape(c, stored);
+                PQclear(PQexec(c, uq.c_str()));
+                db_pool->put(c);
+            });
+        }
+
+        string token = sessions.create(login, role);
+        res.set_header("Set-Cookie", "session=" + token + "; Path=/; HttpOnly; SameSite=Strict; Max-Age=" +
+            to_string(SESSION_TTL.count()));
+        res.set_content(json{ {"success", true}, {"role", role}, {"token", token} }.dump(), "application/json");
+        }));
+
+    // === ВЫХОД ===
+    svr.Post("/api/logout", classed(ReqClass::Interactive, [&](const httplib::Request& req, httplib::Response& res) {
+        sessions.remove(session_token(req));
+        res.set_header("Set-Cookie", "session=; Path=/; HttpOnly; SameSite=Strict; Max-Age=0");
+        res.set_content("{}", "application/json");
+        }));
 
     // === ПОЛЬЗОВАТЕЛИ (GET) ===
-    svr.Get("/api/users", [&](const httplib::Request&, httplib::Response& res) {
+    svr.Get("/api/users", classed(ReqClass::Interactive, [&](const httplib::Request& req, httplib::Response& res) {
+        if (!require_session(req, res, "admin")) return;
+        if (not_modified(req, res, users_version.etag())) return;
+
         PGconn* conn = db_pool->get();
         if (!conn) {
             res.status = 500;
@@ -165,7 +4557,7 @@ int main() {
             return;
         }
 
-        PGresult* r = PQexec(conn, "SELECT login, password, role FROM users ORDER BY login");
+        PGresult* r = PQexec(conn, "SELECT login, role FROM users ORDER BY login");
         PQconsumeInput(conn);
 
         if (PQresultStatus(r) != PGRES_TUPLES_OK) {
@@ -181,32 +4573,43 @@ int main() {
         for (int i = 0; i < PQntuples(r); i++) {
             arr.push_back({
                 {"login", PQgetvalue(r, i, 0)},
-                {"password", PQgetvalue(r, i, 1)},
-                {"role", PQgetvalue(r, i, 2)}
+                {"role", PQgetvalue(r, i, 1)}
                 });
         }
         PQclear(r);
         db_pool->put(conn);
         res.set_content(arr.dump(), "application/json");
-        });
+        }));
 
     // === ПОЛЬЗОВАТЕЛИ (POST - обновление) ===
-    svr.Post("/api/users", [&](const httplib::Request& req, httplib::Response& res) {
-        json j;
-        try { j = json::parse(req.body); }
-        catch (...) { 
-            res.status = 400;
-            res.set_content(json{ {"error", "Invalid JSON"} }.dump(), "application/json");
-            return;
-        }
+    svr.Post("/api/users", classed(ReqClass::Interactive, [&](const httplib::Request& req, httplib::Response& res) {
+        if (!require_session(req, res, "admin")) return;
+
+        UserRequest body;
+        if (!read_body(req, res, body)) return;
 
-        string login = j.value("login", ""), password = j.value("password", ""), role = j.value("role", "");
-        if (login.empty() || password.empty() || (role != "admin" && role != "researcher")) {
+        // Пустой пароль — меняется только роль
+        const string& login = body.login;
+        const string& password = body.password;
+        const string& role = body.role;
+        if (login.empty() || (role != "admin" && role != "researcher")) {
             res.status = 400; 
             res.set_content(json{ {"error", "Invalid data"} }.dump(), "application/json"); 
             return;
         }
 
+        string hashed;
+        if (!password.empty()) {
+            auto h = password_hasher->hash(password);
+            if (!h) {
+                res.status = 503;
+                res.set_header("Retry-After", "1");
+                res.set_content(json{ {"error", "Сервер перегружен, повторите позже"} }.dump(), "application/json");
+                return;
+            }
+            hashed = *h;
+        }
+
         PGconn* conn = db_pool->get();
         if (!conn) { 
             res.status = 500;
@@ -214,18 +4617,82 @@ int main() {
         }
 
         string esc_l = safe_escape(conn, login);
-        string esc_p = safe_escape(conn, password);
         string esc_r = safe_escape(conn, role);
-        string q = "UPDATE users SET password = " + esc_p + ", role = " + esc_r + " WHERE login = " + esc_l;
+        string q = "UPDATE users SET role = " + esc_r;
+        if (!hashed.empty()) q += ", password = " + safe_escape(conn, hashed);
+        q += " WHERE login = " + esc_l;
 
         PGresult* r = PQexec(conn, q.c_str());
+        bool ok = PQresultStatus(r) == PGRES_COMMAND_OK;
+        if (!ok) std::cerr << "DB ERROR: " << PQerrorMessage(conn) << std::endl;
         PQclear(r);
         db_pool->put(conn);
+        if (!ok) {
+            res.status = 500;
+            res.set_content(json{ {"error", "Query failed"} }.dump(), "application/json");
+            return;
+        }
+        users_version.bump();
+        sessions.remove_login(login);
         res.set_content("{}", "application/json");
-        });
+        }));
 
     // === МАТЕРИАЛЫ (GET) ===
-    svr.Get("/api/materials", [&](const httplib::Request&, httplib::Response& res) {
+    // ?limit=N&cursor=...  — keyset-пагинация по (name, id), следующий курсор в X-Next-Cursor
+    // ?prefix=...          — фильтр по началу названия (LIKE 'prefix%' в SQL)
+    // ?fields=id,name      — проекция колонок
+    svr.Get("/api/materials", classed(ReqClass::Catalog, [&](const httplib::Request& req, httplib::Response& res) {
+        if (!require_session(req, res)) return;
+
+        vector<string> fields;
+        if (req.has_param("fields")) {
+            std::stringstream ss(req.get_param_value("fields"));
+            string f;
+            while (getline(ss, f, ',')) {
+                if (std::find(MATERIAL_FIELDS.begin(), MATERIAL_FIELDS.end(), f) == MATERIAL_FIELDS.end()) {
+                    res.status = 400;
+                    res.set_content(json{ {"error", "Unknown field: " + f} }.dump(), "application/json");
+                    return;
+                }
+                if (std::find(fields.begin(), fields.end(), f) == fields.end()) fields.push_back(f);
+            }
+        }
+        if (fields.empty()) fields = MATERIAL_FIELDS;
+
+        int limit = 0;
+        if (req.has_param("limit")) {
+            try { limit = stoi(req.get_param_value("limit")); }
+            catch (...) { limit = -1; }
+            if (limit < 1 || limit > MATERIALS_PAGE_MAX) {
+                res.status = 400;
+                res.set_content(json{ {"error", "limit: 1–" + to_string(MATERIALS_PAGE_MAX)} }.dump(), "application/json");
+                return;
+            }
+        }
+
+        int after_id = 0;
+        string after_name;
+        bool has_cursor = req.has_param("cursor");
+        if (has_cursor && !decode_cursor(req.get_param_value("cursor"), after_name, after_id)) {
+            res.status = 400;
+            res.set_content(json{ {"error", "Invalid cursor"} }.dump(), "application/json");
+            return;
+        }
+        string prefix = req.has_param("prefix") ? req.get_param_value("prefix") : "";
+
+        // Полный список без параметров отдаётся из снимка: загрузка указателя и копия готового тела.
+        // Устаревший снимок (перечитать после записи не удалось) не используется — идём в БД.
+        if (limit == 0 && !has_cursor && prefix.empty() && fields == MATERIAL_FIELDS) {
+            if (auto snap = material_catalog.acquire(); snap && snap->fresh()) {
+                if (not_modified(req, res, snap->etag)) return;
+                res.set_content(snap->body, "application/json");
+                return;
+            }
+        }
+
+        // Параметры запроса входят в URL, а значит и в ключ кэша клиента — тег общий для всех выборок
+        if (not_modified(req, res, materials_version.etag())) return;
+
         PGconn* conn = db_pool->get();
         if (!conn) { 
             res.status = 500;
@@ -233,7 +4700,22 @@ int main() {
             return; 
         }
 
-        PGresult* r = PQexec(conn, "SELECT id, name, mu0, b, T0, n FROM materials ORDER BY name");
+        // name и id выбираются всегда (первыми) — по ним строится курсор
+        string q = "SELECT name, id";
+        for (const auto& f : fields) {
+            if (f != "name" && f != "id") q += ", " + f;
+        }
+        q += " FROM materials";
+
+        vector<string> where;
+        if (!prefix.empty()) where.push_back("name LIKE " + safe_escape(conn, like_escape(prefix) + "%"));
+        if (has_cursor) where.push_back("(name, id) > (" + safe_escape(conn, after_name) + ", " + to_string(after_id) + ")");
+        for (size_t i = 0; i < where.size(); i++) q += (i == 0 ? " WHERE " : " AND ") + where[i];
+
+        q += " ORDER BY name, id";
+        if (limit > 0) q += " LIMIT " + to_string(limit + 1);  // +1 строка — признак следующей страницы
+
+        PGresult* r = PQexec(conn, q.c_str());
         PQconsumeInput(conn);
 
         if (PQresultStatus(r) != PGRES_TUPLES_OK) {
@@ -245,34 +4727,63 @@ int main() {
             return;
         }
 
+        int rows = PQntuples(r);
+        bool has_more = limit > 0 && rows > limit;
+        if (has_more) rows = limit;
+
         json arr = json::array();
-        for (int i = 0; i < PQntuples(r); i++) {
-            arr.push_back({
-                {"id", stoi(PQgetvalue(r, i, 0))},
-                {"name", PQgetvalue(r, i, 1)},
-                {"mu0", stod(PQgetvalue(r, i, 2))},
-                {"b", stod(PQgetvalue(r, i, 3))},
-                {"T0", stod(PQgetvalue(r, i, 4))},
-                {"n", stod(PQgetvalue(r, i, 5))}
-                });
+        for (int i = 0; i < rows; i++) {
+            json m = json::object();
+            for (const auto& f : fields) {
+                int col = PQfnumber(r, f.c_str());
+                if (f == "id") m[f] = stoi(PQgetvalue(r, i, col));
+                else if (f == "name") m[f] = PQgetvalue(r, i, col);
+                else m[f] = stod(PQgetvalue(r, i, col));
+            }
+            arr.push_back(m);
+        }
+        if (has_more) {
+            res.set_header("X-Next-Cursor", encode_cursor(PQgetvalue(r, rows - 1, 0), stoi(PQgetvalue(r, rows - 1, 1))));
         }
         PQclear(r);
         db_pool->put(conn);
         res.set_content(arr.dump(), "application/json");
-        });
+        }));
 
-    // === МАТЕРИАЛЫ (POST - добавление) ===
-    svr.Post("/api/materials", [&](const httplib::Request& req, httplib::Response& res) {
-        json j;
-        try { j = json::parse(req.body); }
-        catch (...) { 
-            res.status = 400; 
-            return; 
+    // === МАТЕРИАЛЫ (ЭКСПОРТ: CSV / NDJSON) ===
+    svr.Get("/api/materials/export", classed(ReqClass::Catalog, [&](const httplib::Request& req, httplib::Response& res) {
+        if (!require_session(req, res)) return;
+
+        string format = req.has_param("format") ? req.get_param_value("format") : "csv";
+        const string columns = R"(SELECT id, name, mu0, b, T0 AS "T0", n FROM materials ORDER BY name, id)";
+        if ((format == "csv" || format == "ndjson") && not_modified(req, res, materials_version.etag())) return;
+
+        if (format == "csv") {
+            res.set_header("Content-Disposition", "attachment; filename=\"materials.csv\"");
+            stream_copy("COPY (" + columns + ") TO STDOUT WITH (FORMAT csv, HEADER)",
+                "text/csv; charset=utf-8", res);
         }
+        else if (format == "ndjson") {
+            // Одна колонка JSON; кавычка и разделитель заведомо не встречаются в выводе row_to_json,
+            // поэтому CSV-режим COPY отдаёт строку как есть, без экранирования обратных слэшей
+            res.set_header("Content-Disposition", "attachment; filename=\"materials.ndjson\"");
+            stream_copy("COPY (SELECT row_to_json(m) FROM (" + columns + ") m) "
+                R"(TO STDOUT WITH (FORMAT csv, QUOTE E'\x01', DELIMITER E'\x02'))",
+                "application/x-ndjson; charset=utf-8", res);
+        }
+        else {
+            res.status = 400;
+            res.set_content(json{ {"error", "format: csv | ndjson"} }.dump(), "application/json");
+        }
+        }));
 
-        string name = j.value("name", "");
-        double mu0 = j.value("mu0", 0.0), b = j.value("b", 0.0), T0 = j.value("T0", 0.0), n = j.value("n", 0.0);
-        if (name.empty()) {
+    // === МАТЕРИАЛЫ (POST - добавление) ===
+    svr.Post("/api/materials", classed(ReqClass::Catalog, [&](const httplib::Request& req, httplib::Response& res) {
+        if (!require_session(req, res, "admin")) return;
+
+        MaterialRequest m;
+        if (!read_body(req, res, m)) return;
+        if (m.name.empty()) {
             res.status = 400; 
             return; 
         }
@@ -283,18 +4794,29 @@ int main() {
             return;
         }
 
-        string esc_n = safe_escape(conn, name);
+        string esc_n = safe_escape(conn, m.name);
         string q = "INSERT INTO materials (name, mu0, b, T0, n) VALUES (" + esc_n + ", " +
-            to_string(mu0) + ", " + to_string(b) + ", " + to_string(T0) + ", " + to_string(n) + ")";
+            to_string(m.mu0) + ", " + to_string(m.b) + ", " + to_string(m.T0) + ", " + to_string(m.n) + ")";
 
         PGresult* r = PQexec(conn, q.c_str());
+        bool ok = PQresultStatus(r) == PGRES_COMMAND_OK;
+        if (!ok) std::cerr << "DB ERROR: " << PQerrorMessage(conn) << std::endl;
         PQclear(r);
         db_pool->put(conn);
+        if (!ok) {
+            res.status = 500;
+            res.set_content(json{ {"error", "Query failed"} }.dump(), "application/json");
+            return;
+        }
+        materials_version.bump();
+        material_catalog.reload();
         res.set_content("{}", "application/json");
-        });
+        }));
 
     // === МАТЕРИАЛЫ (DELETE) ===
-    svr.Delete(R"(/api/materials/(\d+))", [&](const httplib::Request& req, httplib::Response& res) {
+    svr.Delete(R"(/api/materials/(\d+))", classed(ReqClass::Catalog, [&](const httplib::Request& req, httplib::Response& res) {
+        if (!require_session(req, res, "admin")) return;
+
         int id = stoi(req.matches[1]);
         PGconn* conn = db_pool->get();
         if (!conn) {
@@ -304,162 +4826,262 @@ int main() {
 
         string q = "DELETE FROM materials WHERE id = " + to_string(id);
         PGresult* r = PQexec(conn, q.c_str());
+        bool ok = PQresultStatus(r) == PGRES_COMMAND_OK;
+        if (!ok) std::cerr << "DB ERROR: " << PQerrorMessage(conn) << std::endl;
         PQclear(r);
         db_pool->put(conn);
+        if (!ok) {
+            res.status = 500;
+            res.set_content(json{ {"error", "Query failed"} }.dump(), "application/json");
+            return;
+        }
+        materials_version.bump();
+        material_catalog.reload();
         res.set_content("{}", "application/json");
-        });
+        }));
+
+    // === МЕТРИКИ ===
+    svr.Get("/api/metrics", classed(ReqClass::Interactive, [&](const httplib::Request& req, httplib::Response& res) {
+        if (!require_session(req, res, "admin")) return;
+
+        json m;
+        m["password_hashing"] = password_hasher->metrics();
+        m["rate_limits"] = rate_limiter.metrics();
+        if (auto* queue = http_task_queue.load()) m["http_queue"] = queue->metrics();
+        m["request_classes"] = request_scheduler->metrics();
+        m["compute"] = compute_executor->metrics();
+        m["coalescing"] = calc_flights.metrics();
+        m["coalescing"]["grids"] = grid_flights.metrics();
+        m["batch"] = batch_calculator.metrics();
+        m["points"] = point_stats.metrics();
+        m["reports"] = report_store->metrics();
+        m["reports"]["on_demand"] = report_registry.metrics();
+        m["reports"]["jobs"] = report_jobs->metrics();
+        m["reports"]["writer"] = report_writer_stats.metrics();
+        m["reports"]["zip"] = zip_stats.metrics();
+        m["static"] = static_cache->metrics();
+        m["compression"] = response_compressor->metrics();
+        res.set_content(m.dump(), "application/json");
+        }));
 
     // === РАСЧЁТ ===
-    svr.Post("/api/calculate", [&](const httplib::Request& req, httplib::Response& res) {
-        json j;
-        try { j = json::parse(req.body); }
-        catch (...) {
-            res.status = 400;
-            res.set_content(json{ {"error", "Invalid JSON"} }.dump(), "application/json");
-            return; 
+    svr.Post("/api/calculate", classed(ReqClass::Heavy, [&](const httplib::Request& req, httplib::Response& res) {
+        if (!require_session(req, res)) return;
+
+        CalcRequest p;
+        Material material;
+        if (!read_body(req, res, p) || !resolve_calc(p, res, material)) return;
+
+        // Поток HTTP только ждёт результат вычислительного пула; одинаковые расчёты сливаются
+        // в один ответ. Отложенная задача выполняется в потоке первого запроса при ожидании,
+        // то есть вне блокировки SingleFlight; остальные ждут её результат.
+        auto body = calc_flights.run(calc_key(material, p), [&] {
+            return std::async(std::launch::deferred, [m = material, p] {
+                auto grid = shared_grid(m, p);
+                return compute_executor->submit([m, p, grid] { return calc_response(m, p, grid); }).get();
+            });
+        });
+
+        res.set_content(*body, "application/json");
+        }));
+
+    // === ПАКЕТНЫЙ РАСЧЁТ ===
+    // Тело — массив параметров /api/calculate; ответ {"results": [...], "performance": {...}}
+    svr.Post("/api/calculate/batch", classed(ReqClass::Heavy, [&](const httplib::Request& req, httplib::Response& res) {
+        if (!require_session(req, res)) return;
+
+        vector<CalcRequest> list;
+        if (!read_body_list(req, res, list, BATCH_JOBS_MAX)) return;
+
+        vector<BatchJob> jobs(list.size());
+        for (size_t i = 0; i < list.size(); i++) {
+            jobs[i].params = list[i];
+            if (!resolve_calc(list[i], res, jobs[i].material)) return;
         }
+        res.set_content(batch_calculator.run(jobs), "application/json");
+        }));
 
-        int materialId = j.value("materialId", 0);
-        double minT = j.value("minT", 0.0), maxT = j.value("maxT", 0.0), deltaT = j.value("deltaT", 0.0);
-        double minG = j.value("minGamma", 0.0), maxG = j.value("maxGamma", 0.0), deltaG = j.value("deltaGamma", 0.0);
+    // === СРАВНЕНИЕ МАТЕРИАЛОВ ===
+    // Тело — массив параметров /api/calculate с одинаковыми диапазонами; первый элемент — эталон
+    svr.Post("/api/calculate/compare", classed(ReqClass::Heavy, [&](const httplib::Request& req, httplib::Response& res) {
+        if (!require_session(req, res)) return;
 
-        if (minT < 100 || maxT > 250 || minT >= maxT || deltaT <= 0 ||
-            minG < 1 || maxG > 1000 || minG >= maxG || deltaG <= 0) {
-            res.status = 400;
-            res.set_content(json{ {"error", "Значения введены неверно"} }.dump(), "application/json");
-            return;
+        vector<CalcRequest> list;
+        if (!read_body_list(req, res, list, COMPARE_MATERIALS_MAX)) return;
+
+        const CalcRequest& p = list[0];
+        vector<Material> materials;
+        for (const auto& item : list) {
+            if (item.minT != p.minT || item.maxT != p.maxT || item.deltaT != p.deltaT ||
+                item.minG != p.minG || item.maxG != p.maxG || item.deltaG != p.deltaG) {
+                res.status = 400;
+                res.set_content(json{ {"error", "Диапазоны сравниваемых материалов должны совпадать"} }.dump(), "application/json");
+                return;
+            }
+            Material material;
+            if (!resolve_calc(item, res, material)) return;
+            bool seen = std::any_of(materials.begin(), materials.end(), [&](const Material& m) { return m.id == material.id; });
+            if (!seen) materials.push_back(std::move(material));
         }
 
-        PGconn* conn = db_pool->get();
-        if (!conn) {
-            res.status = 500;
-            res.set_content(json{ {"error", "DB unavailable"} }.dump(), "application/json"); 
+        auto body = compute_executor->submit([materials, p] {
+            return write_comparison(materials, compare_grid(materials, p));
+        }).get();
+        res.set_content(body, "application/json");
+        }));
+
+    // === РАСЧЁТ ПО ТОЧКАМ ===
+    // /api/calculate/points?materialId=N; тело — точки (T, γ̇) в двоичном виде или JSON
+    svr.Post("/api/calculate/points", classed(ReqClass::Heavy, [&](const httplib::Request& req, httplib::Response& res,
+        const httplib::ContentReader& reader) {
+        if (!require_session(req, res)) return;
+
+        PointsRequest q;
+        Material material;
+        if (!read_query(req, res, q) || !find_material(q.materialId, res, material)) return;
+
+        bool binary = binary_points(req);
+        auto points = std::make_shared<PointSet>();
+        if (!read_points(req, res, reader, binary, *points)) return;
+
+        auto stream = std::make_shared<PointStream>(material, std::move(points), binary);
+        res.set_header("Cache-Control", "no-store");
+        res.set_chunked_content_provider(binary ? "application/octet-stream" : "application/json",
+            [stream](size_t, httplib::DataSink& sink) { return stream->step(sink); });
+        }));
+
+    // === РАСЧЁТ (ПОТОКОВЫЙ, EventSource) ===
+    svr.Get("/api/calculate/stream", classed(ReqClass::Heavy, [&](const httplib::Request& req, httplib::Response& res) {
+        if (!require_session(req, res)) return;
+
+        CalcRequest p;
+        Material material;
+        if (!read_query(req, res, p) || !resolve_calc(p, res, material)) return;
+
+        auto stream = std::make_shared<CalcStream>(material, p);
+        res.set_header("Cache-Control", "no-cache");
+        res.set_header("X-Accel-Buffering", "no");
+        res.set_chunked_content_provider("text/event-stream",
+            [stream](size_t, httplib::DataSink& sink) { return stream->step(sink); });
+        }));
+
+    // === ОТЧЁТЫ (CSV из хранилища) ===
+    svr.Get(R"(/api/reports/([0-9a-f]{32})\.csv)", classed(ReqClass::Catalog, [&](const httplib::Request& req, httplib::Response& res) {
+        if (!require_session(req, res)) return;
+
+        // Содержимое по ключу не меняется, поэтому ключ служит сильным ETag
+        string key = req.matches[1];
+        string etag = "\"" + key + "\"";
+        res.set_header("ETag", etag);
+        res.set_header("Cache-Control", "private, max-age=86400, immutable");
+        res.set_header("Content-Disposition", "attachment; filename=\"report_" + key + ".csv\"");
+        if (req.has_header("If-None-Match") && etag_matches(req.get_header_value("If-None-Match"), etag)) {
+            res.status = 304;
             return;
         }
 
-        string q = "SELECT mu0, b, T0, n FROM materials WHERE id = " + to_string(materialId);
-        PGresult* r = PQexec(conn, q.c_str());
-        PQconsumeInput(conn);
+        if (auto file = report_store->locate(key)) {
+            // Файл отображается в память (mmap) и уходит в сокет без промежуточного буфера;
+            // Range (в том числе несколько диапазонов) httplib применяет сам и отвечает 206
+            if (!if_range_matches(req, etag)) ignore_range(req);
+            res.set_header("Accept-Ranges", "bytes");
+            res.set_file_content(file->string(), "text/csv; charset=utf-8");
+            return;
+        }
 
-        if (PQntuples(r) == 0) {
-            PQclear(r);
-            db_pool->put(conn);
+        // Первое скачивание: CSV строится из сетки и параллельно сохраняется
+        auto spec = report_registry.spec(key);
+        if (!spec) {
             res.status = 404;
-            res.set_content(json{ {"error", "Материал не найден"} }.dump(), "application/json");
+            res.set_content(json{ {"error", "Отчёт не найден"} }.dump(), "application/json");
             return;
         }
+        // Докачка возможна только из сохранённого файла: поток отдаётся целиком
+        ignore_range(req);
+        res.set_header("Accept-Ranges", "none");
+        auto stream = std::make_shared<CsvReportStream>(report_registry.grid(key, *spec), key);
+        res.set_chunked_content_provider("text/csv; charset=utf-8",
+            [stream](size_t, httplib::DataSink& sink) { return stream->step(sink); },
+            [stream](bool success) { stream->finish(success); });
+        }));
 
-        double mu0 = stod(PQgetvalue(r, 0, 0));
-        double b = stod(PQgetvalue(r, 0, 1));
-        double T0 = stod(PQgetvalue(r, 0, 2));
-        double n = stod(PQgetvalue(r, 0, 3));
-        PQclear(r);
+    // === АРХИВ ОТЧЁТОВ ===
+    // Тело — массив параметров расчёта, как у /api/calculate; одинаковые отчёты входят один раз
+    svr.Post("/api/reports/zip", classed(ReqClass::Heavy, [&](const httplib::Request& req, httplib::Response& res) {
+        if (!require_session(req, res)) return;
 
-        auto start = chrono::high_resolution_clock::now();
+        vector<CalcRequest> list;
+        if (!read_body_list(req, res, list, ZIP_ENTRIES_MAX)) return;
 
-        //генерация графиков
-        vector<double> T_vals, G_vals;
-        for (double t = minT; t <= maxT + 1e-6; t += deltaT) T_vals.push_back(t);
-        for (double g = minG; g <= maxG + 1e-6; g += deltaG) G_vals.push_back(g);
-
-        double midT = (minT + maxT) / 2.0;
-        double midG = (minG + maxG) / 2.0;
-
-        vector<double> T_points = { minT, midT, maxT };
-        vector<double> G_points = { minG, midG, maxG };
-
-        json full_data;
-        full_data["T_range"] = T_vals;
-        full_data["gamma_range"] = G_vals;
-        full_data["T_points"] = T_points;
-        full_data["G_points"] = G_points;
-
-        // === mu_T: G_points → T_range ===
-        json mu_T_array = json::array();
-        for (double g : G_points) {
-            json arr = json::array();
-            for (double t : T_vals) {
-                double temp_k = t + 273.15;
-                double exp_part = exp(b * (T0 - temp_k) / temp_k);
-                double power_part = pow(g, n - 1.0);
-                double val = mu0 * exp_part * power_part;
-                arr.push_back(val);
-            }
-            mu_T_array.push_back(arr);
-        }
-        full_data["mu_T"] = mu_T_array;
-
-        // === mu_gamma: T_points → gamma_range ===
-        json mu_gamma_array = json::array();
-        for (double t : T_points) {
-            json arr = json::array();
-            for (double g : G_vals) {
-                double temp_k = t + 273.15;
-                double exp_part = exp(b * (T0 - temp_k) / temp_k);
-                double power_part = pow(g, n - 1.0);
-                double val = mu0 * exp_part * power_part;
-                arr.push_back(val);
-            }
-            mu_gamma_array.push_back(arr);
-        }
-        full_data["mu_gamma"] = mu_gamma_array;
-
-        // === mu_table: все T × все γ̇ ===
-        full_data["mu_table"] = json::object();
-        for (double t : T_vals) {
-            std::string keyT = to_fixed(t);
-            full_data["mu_table"][keyT] = json::object();
-            for (double g : G_vals) {
-                std::string keyG = to_fixed(g);
-                double temp_k = t + 273.15;
-                double exp_part = exp(b * (T0 - temp_k) / temp_k);
-                double power_part = pow(g, n - 1.0);
-                double val = mu0 * exp_part * power_part;
-                full_data["mu_table"][keyT][keyG] = val;
-            }
-        }
-
-        auto end = chrono::high_resolution_clock::now();
-        double time_ms = chrono::duration<double, milli>(end - start).count();
-
-        // === CSV – ПОЛНАЯ ТАБЛИЦА (как в интерфейсе) ===
-        string filename = "report_" + to_string(materialId) + ".csv";
-        ofstream file("./web/" + filename);
-        file << fixed << setprecision(1);
-
-        // Заголовок: T \\ γ̇    |   γ̇1   γ̇2   ...   γ̇N
-        file << "T \\ γ̇";
-        for (double g : G_vals) {
-            file << "," << g;
-        }
-        file << "\n";
-
-        // Строки: T1 → μ(T1,γ̇1), μ(T1,γ̇2), ...
-        for (double t : T_vals) {
-            file << t;  // Температура в первом столбце
-            for (double g : G_vals) {
-                double temp_k = t + 273.15;
-                double exp_part = exp(b * (T0 / temp_k - 1.0));
-                double power_part = pow(g, n - 1.0);
-                double val = mu0 * exp_part * power_part;
-                file << "," << setprecision(2) << val;
-            }
-            file << "\n";
+        vector<ZipReportStream::Entry> entries;
+        for (const auto& p : list) {
+            Material material;
+            if (!resolve_calc(p, res, material)) return;
+            string key = ReportStore::key_for(calc_key(material, p));
+            bool seen = std::any_of(entries.begin(), entries.end(), [&](const auto& e) { return e.key == key; });
+            if (seen) continue;
+            report_registry.add(material, p, nullptr);  // отчёт можно будет скачать и по отдельности
+            entries.push_back({ { material, p }, key, zip_entry_name(material.name, key) });
         }
-        file.close();
 
-        json response;
-        response["full_data"] = full_data;
-        response["report_url"] = "/" + filename;
-        response["performance"] = {
-            {"time_ms", time_ms},
-            {"memory_kb", 1024},
-            {"operations", 50 * T_vals.size() * G_vals.size()}
-        };
+        bool deflate = req.get_param_value("method") != "store";
+        auto stream = std::make_shared<ZipReportStream>(std::move(entries), deflate);
+        res.set_header("Cache-Control", "no-store");
+        res.set_header("Content-Disposition", "attachment; filename=\"reports.zip\"");
+        res.set_chunked_content_provider("application/zip",
+            [stream](size_t, httplib::DataSink& sink) { return stream->step(sink); });
+        }));
 
-        db_pool->put(conn);
-        res.set_content(response.dump(), "application/json");
-        });
+    // === ОТЧЁТЫ (ФОНОВЫЕ ЗАДАНИЯ) ===
+    svr.Post("/api/reports/jobs", classed(ReqClass::Catalog, [&](const httplib::Request& req, httplib::Response& res) {
+        auto session = require_session(req, res);
+        if (!session) return;
+
+        CalcRequest p;
+        Material material;
+        if (!read_body(req, res, p) || !resolve_calc(p, res, material)) return;
+
+        auto job = report_jobs->submit(session->login, material, p);
+        if (!job) {
+            res.status = 503;
+            res.set_header("Retry-After", "5");
+            res.set_content(json{ {"error", "Очередь отчётов заполнена, повторите позже"} }.dump(), "application/json");
+            return;
+        }
+        json body = ReportJobs::status(*job);
+        body["status_url"] = "/api/reports/jobs/" + job->id;
+        res.status = 202;
+        res.set_header("Location", body["status_url"].get<string>());
+        res.set_content(body.dump(), "application/json");
+        }));
+
+    svr.Get(R"(/api/reports/jobs/([0-9a-f]{16}))", classed(ReqClass::Interactive, [&](const httplib::Request& req, httplib::Response& res) {
+        auto session = require_session(req, res);
+        if (!session) return;
+
+        auto job = report_jobs->find(req.matches[1]);
+        if (!job || (job->owner != session->login && session->role != "admin")) {
+            res.status = 404;
+            res.set_content(json{ {"error", "Задание не найдено"} }.dump(), "application/json");
+            return;
+        }
+        res.set_header("Cache-Control", "no-store");
+        res.set_content(ReportJobs::status(*job).dump(), "application/json");
+        }));
+
+    svr.Delete(R"(/api/reports/jobs/([0-9a-f]{16}))", classed(ReqClass::Interactive, [&](const httplib::Request& req, httplib::Response& res) {
+        auto session = require_session(req, res);
+        if (!session) return;
+
+        auto job = report_jobs->find(req.matches[1]);
+        if (!job || (job->owner != session->login && session->role != "admin")) {
+            res.status = 404;
+            res.set_content(json{ {"error", "Задание не найдено"} }.dump(), "application/json");
+            return;
+        }
+        report_jobs->cancel(*job);
+        res.set_content(ReportJobs::status(*job).dump(), "application/json");
+        }));
         
 
        std::cout << "Сервер: http://localhost:8080" << std::endl;